@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2023 Andrey Proskurin (proskur1n)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include "checksum.h"
+#include "cpu.h"
+
+#ifdef CPU_X86
+#include <immintrin.h>
+#endif
+
+#define CRC_POLY 0xedb88320 // Reflected polynomial of PNG and zlib.
+#define ADLER_MOD 65521
+#define ADLER_NMAX 5552 // Bytes after which the sums of adler32_update could overflow.
+
+// crc_tables[k][b] is the CRC of byte b followed by k zero bytes.
+uint32_t crc_tables[8][256];
+pthread_once_t crc_tables_once = PTHREAD_ONCE_INIT;
+
+void init_crc_tables(void)
+{
+	for (uint32_t b = 0; b < 256; ++b) {
+		uint32_t c = b;
+		for (int k = 0; k < 8; ++k) {
+			c = c & 1 ? (c >> 1) ^ CRC_POLY : c >> 1;
+		}
+		crc_tables[0][b] = c;
+	}
+	for (int k = 1; k < 8; ++k) {
+		for (int b = 0; b < 256; ++b) {
+			uint32_t c = crc_tables[k - 1][b];
+			crc_tables[k][b] = (c >> 8) ^ crc_tables[0][c & 0xff];
+		}
+	}
+}
+
+/// Updates the inverted CRC register 'c' eight bytes at a time.
+uint32_t crc32_slice8(uint32_t c, unsigned char const *p, size_t size)
+{
+	for (; size > 0 && ((uintptr_t) p & 7) != 0; --size) {
+		c = (c >> 8) ^ crc_tables[0][(c ^ *p++) & 0xff];
+	}
+	for (; size >= 8; size -= 8, p += 8) {
+		uint32_t lo, hi;
+		memcpy(&lo, p, 4);
+		memcpy(&hi, p + 4, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		lo = __builtin_bswap32(lo);
+		hi = __builtin_bswap32(hi);
+#endif
+		lo ^= c;
+		c = crc_tables[7][lo & 0xff] ^ crc_tables[6][(lo >> 8) & 0xff]
+				^ crc_tables[5][(lo >> 16) & 0xff] ^ crc_tables[4][lo >> 24]
+				^ crc_tables[3][hi & 0xff] ^ crc_tables[2][(hi >> 8) & 0xff]
+				^ crc_tables[1][(hi >> 16) & 0xff] ^ crc_tables[0][hi >> 24];
+	}
+	for (; size > 0; --size) {
+		c = (c >> 8) ^ crc_tables[0][(c ^ *p++) & 0xff];
+	}
+	return c;
+}
+
+#ifdef CPU_X86
+/// Updates the inverted CRC register 'c' by folding 64 bytes at a time with carry-less
+/// multiplication, as described in Intel's "Fast CRC Computation for Generic Polynomials Using
+/// PCLMULQDQ Instruction". 'size' must be a multiple of 16 and at least 64.
+__attribute__((target("pclmul,sse4.1")))
+uint32_t crc32_pclmul(uint32_t c, unsigned char const *p, size_t size)
+{
+	// Powers of x modulo the polynomial that fold 512, 128 and 64 bits, and the Barrett constants.
+	__m128i const k1k2 = _mm_set_epi64x(0x1c6e41596, 0x154442bd4);
+	__m128i const k3k4 = _mm_set_epi64x(0x0ccaa009e, 0x1751997d0);
+	__m128i const k5 = _mm_set_epi64x(0, 0x163cd6124);
+	__m128i const poly = _mm_set_epi64x(0x1f7011641, 0x1db710641);
+	__m128i const low32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+	__m128i x1 = _mm_xor_si128(_mm_loadu_si128((__m128i const *) p), _mm_cvtsi32_si128(c));
+	__m128i x2 = _mm_loadu_si128((__m128i const *) (p + 16));
+	__m128i x3 = _mm_loadu_si128((__m128i const *) (p + 32));
+	__m128i x4 = _mm_loadu_si128((__m128i const *) (p + 48));
+	for (p += 64, size -= 64; size >= 64; p += 64, size -= 64) {
+		__m128i y1 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+		__m128i y2 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+		__m128i y3 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+		__m128i y4 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, y1), _mm_loadu_si128((__m128i const *) p));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, y2), _mm_loadu_si128((__m128i const *) (p + 16)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, y3), _mm_loadu_si128((__m128i const *) (p + 32)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, y4), _mm_loadu_si128((__m128i const *) (p + 48)));
+	}
+
+	// Fold the four lanes and the remaining 16-byte blocks into one.
+	__m128i rest[3] = {x2, x3, x4};
+	for (int i = 0; i < 3 || size >= 16; ++i) {
+		__m128i next;
+		if (i < 3) {
+			next = rest[i];
+		} else {
+			next = _mm_loadu_si128((__m128i const *) p);
+			p += 16;
+			size -= 16;
+		}
+		__m128i y = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, y), next);
+	}
+
+	// Fold 128 bits to 64 and reduce to 32 bits.
+	x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, low32), k5, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+	x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, low32), poly, 0x10);
+	x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, low32), poly, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+	return _mm_extract_epi32(x1, 1);
+}
+#endif
+
+uint32_t crc32_update(uint32_t crc, void const *data, size_t size)
+{
+	unsigned char const *p = data;
+	uint32_t c = ~crc;
+#ifdef CPU_X86
+	if (cpu_level() >= CPU_SSE4 && size >= 64) {
+		size_t n = size & ~(size_t) 15;
+		c = crc32_pclmul(c, p, n);
+		p += n;
+		size -= n;
+	}
+#endif
+	if (size > 0) {
+		pthread_once(&crc_tables_once, init_crc_tables);
+		c = crc32_slice8(c, p, size);
+	}
+	return ~c;
+}
+
+/// Adds 'size' bytes to the Adler-32 sums 'a' and 'b', reducing them every ADLER_NMAX bytes.
+void adler32_scalar(uint32_t *a, uint32_t *b, unsigned char const *p, size_t size)
+{
+	uint32_t s1 = *a, s2 = *b;
+	while (size > 0) {
+		size_t n = size < ADLER_NMAX ? size : ADLER_NMAX;
+		size -= n;
+		for (; n >= 4; n -= 4, p += 4) {
+			s2 += 4 * s1 + 4 * p[0] + 3 * p[1] + 2 * p[2] + p[3];
+			s1 += p[0] + p[1] + p[2] + p[3];
+		}
+		for (; n > 0; --n) {
+			s1 += *p++;
+			s2 += s1;
+		}
+		s1 %= ADLER_MOD;
+		s2 %= ADLER_MOD;
+	}
+	*a = s1;
+	*b = s2;
+}
+
+#ifdef CPU_X86
+__attribute__((target("avx2")))
+uint32_t sum_epi32(__m256i v)
+{
+	__m128i s = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+	s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+	s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+	return _mm_cvtsi128_si32(s);
+}
+
+/// Adds whole 32-byte blocks to the Adler-32 sums and returns the number of bytes consumed. For
+/// every block, 'b' grows by 32 times the previous 'a' plus the bytes weighted 32 down to 1.
+__attribute__((target("avx2")))
+size_t adler32_avx2(uint32_t *a, uint32_t *b, unsigned char const *p, size_t size)
+{
+	__m256i const weights = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20,
+			19, 18, 17, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+	__m256i const ones = _mm256_set1_epi16(1);
+	__m256i const zero = _mm256_setzero_si256();
+	size_t blocks = size / 32;
+	uint32_t s1 = *a, s2 = *b;
+	while (blocks > 0) {
+		size_t n = blocks < ADLER_NMAX / 32 ? blocks : ADLER_NMAX / 32;
+		blocks -= n;
+		// 'prefix' accumulates 'a' before every block, it is multiplied by 32 at the end.
+		__m256i prefix = _mm256_setr_epi32(s1 * n, 0, 0, 0, 0, 0, 0, 0);
+		__m256i v1 = zero;
+		__m256i v2 = _mm256_setr_epi32(s2, 0, 0, 0, 0, 0, 0, 0);
+		for (; n > 0; --n, p += 32) {
+			__m256i bytes = _mm256_loadu_si256((__m256i const *) p);
+			prefix = _mm256_add_epi32(prefix, v1);
+			v1 = _mm256_add_epi32(v1, _mm256_sad_epu8(bytes, zero));
+			v2 = _mm256_add_epi32(v2, _mm256_madd_epi16(_mm256_maddubs_epi16(bytes, weights), ones));
+		}
+		v2 = _mm256_add_epi32(v2, _mm256_slli_epi32(prefix, 5));
+		s1 = (s1 + sum_epi32(v1)) % ADLER_MOD;
+		s2 = sum_epi32(v2) % ADLER_MOD;
+	}
+	*a = s1;
+	*b = s2;
+	return size / 32 * 32;
+}
+#endif
+
+uint32_t adler32_update(uint32_t adler, void const *data, size_t size)
+{
+	unsigned char const *p = data;
+	uint32_t a = adler & 0xffff, b = adler >> 16;
+#ifdef CPU_X86
+	if (cpu_level() >= CPU_AVX2) {
+		size_t n = adler32_avx2(&a, &b, p, size);
+		p += n;
+		size -= n;
+	}
+#endif
+	adler32_scalar(&a, &b, p, size);
+	return b << 16 | a;
+}
+
+uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, size_t size2)
+{
+	// a = a1 + a2 - 1 and b = b1 + b2 + size2 * (a1 - 1), all modulo ADLER_MOD.
+	uint32_t const rem = size2 % ADLER_MOD;
+	uint32_t a1 = adler1 & 0xffff, b1 = adler1 >> 16;
+	uint32_t a2 = adler2 & 0xffff, b2 = adler2 >> 16;
+	uint32_t a = (a1 + a2 + ADLER_MOD - 1) % ADLER_MOD;
+	uint32_t b = (uint32_t) (((uint64_t) rem * a1 + b1 + b2 + ADLER_MOD - rem) % ADLER_MOD);
+	return b << 16 | a;
+}
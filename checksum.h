@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2023 Andrey Proskurin (proskur1n)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Updates the CRC-32 of PNG chunks and zlib 'crc' with 'size' more bytes. The CRC of no data is 0,
+/// so crc32_update(0, data, size) computes the CRC of 'data'. Uses carry-less multiplication when
+/// the processor supports it, and a slice-by-8 table otherwise.
+uint32_t crc32_update(uint32_t crc, void const *data, size_t size);
+
+/// Updates the Adler-32 checksum of zlib 'adler' with 'size' more bytes. The checksum of no data is
+/// 1. Uses AVX2 when the processor supports it.
+uint32_t adler32_update(uint32_t adler, void const *data, size_t size);
+
+/// Returns the Adler-32 checksum of the concatenation of two byte sequences, given the checksum of
+/// each and the length of the second one.
+uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, size_t size2);
+
+#endif
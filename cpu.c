@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2023 Andrey Proskurin (proskur1n)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "cpu.h"
+#include "util.h"
+
+enum cpu_level detected_level = CPU_BASELINE;
+pthread_once_t cpu_level_once = PTHREAD_ONCE_INIT;
+
+void detect_cpu_level(void)
+{
+	enum cpu_level level = CPU_BASELINE;
+#ifdef CPU_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("pclmul")) {
+		level = CPU_SSE4;
+		if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")
+				&& __builtin_cpu_supports("bmi") && __builtin_cpu_supports("bmi2")) {
+			level = CPU_AVX2;
+			if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")
+					&& __builtin_cpu_supports("avx512dq") && __builtin_cpu_supports("avx512vl")) {
+				level = CPU_AVX512;
+			}
+		}
+	}
+#endif
+	char const *env = getenv("MEDIANCUT_CPU");
+	if (env != NULL && *env != '\0') {
+		static char const *const names[] = {"baseline", "sse4", "avx2", "avx512"};
+		enum cpu_level requested = CPU_BASELINE;
+		while (strcmp(env, names[requested]) != 0) {
+			if (++requested > CPU_AVX512) {
+				fatal("unknown MEDIANCUT_CPU '%s'", env);
+			}
+		}
+		// Never go above what the processor supports.
+		if (requested < level) {
+			level = requested;
+		}
+	}
+	detected_level = level;
+}
+
+enum cpu_level cpu_level(void)
+{
+	pthread_once(&cpu_level_once, detect_cpu_level);
+	return detected_level;
+}
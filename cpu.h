@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2023 Andrey Proskurin (proskur1n)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef CPU_H
+#define CPU_H
+
+/// Instruction sets that the hot kernels are compiled for. Every level includes the ones below it.
+enum cpu_level {
+	CPU_BASELINE, // Portable code, SSE2 on x86-64.
+	CPU_SSE4, // SSE4.1 and carry-less multiplication.
+	CPU_AVX2, // AVX2, FMA, BMI1 and BMI2.
+	CPU_AVX512, // AVX-512 F, BW, DQ and VL.
+};
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CPU_X86
+#define CPU_TARGET_AVX2 __attribute__((target("avx2,fma,bmi,bmi2")))
+#define CPU_TARGET_AVX512 __attribute__((target("avx512f,avx512bw,avx512dq,avx512vl,avx2,fma,bmi,bmi2")))
+#endif
+
+/// Marks the portable body of a kernel. Inlining it into functions declared with CPU_TARGET_AVX2
+/// and CPU_TARGET_AVX512 lets the compiler vectorize one copy for each instruction set.
+#define CPU_KERNEL static inline __attribute__((always_inline))
+
+/// Calls name_avx512, name_avx2 or name_baseline with the given arguments, whichever is the best
+/// for cpu_level().
+#ifdef CPU_X86
+#define CPU_DISPATCH(name, ...) (cpu_level() >= CPU_AVX512 ? name##_avx512(__VA_ARGS__) : \
+		cpu_level() >= CPU_AVX2 ? name##_avx2(__VA_ARGS__) : name##_baseline(__VA_ARGS__))
+#else
+#define CPU_DISPATCH(name, ...) name##_baseline(__VA_ARGS__)
+#endif
+
+/// Returns the best instruction set supported by the processor. The MEDIANCUT_CPU environment
+/// variable (baseline, sse4, avx2 or avx512) lowers it, e.g. to test the other code paths.
+enum cpu_level cpu_level(void);
+
+#endif
@@ -0,0 +1,1116 @@
+/*
+ * Copyright (c) 2023 Andrey Proskurin (proskur1n)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include "deflate.h"
+#include "checksum.h"
+#include "util.h"
+
+// See RFC 1950 and RFC 1951 for the zlib and deflate formats.
+#define WINDOW_SIZE 32768
+#define MIN_MATCH 3
+#define MAX_MATCH 258
+#define LITLEN_CODES 286
+#define FIXED_LITLEN_CODES 288 // The fixed code also assigns codes to the unused symbols 286 and 287.
+#define DIST_CODES 30
+#define CODELEN_CODES 19
+#define END_OF_BLOCK 256
+#define MAX_CODE_BITS 15
+#define MAX_CODELEN_BITS 7
+
+#define HASH_SIZE (1 << 15)
+#define MAX_CHAIN 256 // Candidates visited per position by the match finder.
+#define NICE_LENGTH 64 // Matches at least this long end the search at their position.
+#define MAX_PAIRS 16 // Matches kept per position, see find_matches.
+#define BAND_SIZE DEFLATE_BAND_SIZE
+#define MAX_BLOCKS 32 // Maximum number of blocks per band.
+#define STREAM_BLOCK_SIZE (1 << 16) // Symbols per block of deflate_stream.
+#define STREAM_BUFFER_SIZE (4 * WINDOW_SIZE) // Input bytes that deflate_stream keeps at once.
+
+unsigned short const length_base[29] = {
+		3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115,
+		131, 163, 195, 227, 258,
+};
+unsigned char const length_extra[29] = {
+		0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+unsigned short const dist_base[DIST_CODES] = {
+		1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537,
+		2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577,
+};
+unsigned char const dist_extra[DIST_CODES] = {
+		0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+};
+// Order in which the code lengths of the code length alphabet are stored.
+unsigned char const codelen_order[CODELEN_CODES] = {
+		16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15,
+};
+
+/// Returns the length code (0 to 28) of a match of 'len' bytes.
+int length_code(int len)
+{
+	if (len <= 10) {
+		return len - 3;
+	}
+	if (len == MAX_MATCH) {
+		return 28;
+	}
+	int v = len - 3;
+	int log = 31 - __builtin_clz(v);
+	return 4 * (log - 1) + ((v >> (log - 2)) & 3);
+}
+
+/// Returns the distance code (0 to 29) of a match 'dist' bytes back.
+int dist_code(int dist)
+{
+	if (dist <= 4) {
+		return dist - 1;
+	}
+	int v = dist - 1;
+	int log = 31 - __builtin_clz(v);
+	return 2 * log + ((v >> (log - 1)) & 1);
+}
+
+/// Deflate symbols: a literal byte if 'dist' is 0, a match of 'litlen' bytes 'dist' bytes back
+/// otherwise.
+struct lz77 {
+	uint16_t *litlens;
+	uint16_t *dists;
+	size_t count;
+	size_t capacity;
+};
+
+void lz77_reserve(struct lz77 *lz77, size_t capacity)
+{
+	if (lz77->capacity < capacity) {
+		lz77->capacity = capacity;
+		lz77->litlens = realloc(lz77->litlens, capacity * sizeof(uint16_t));
+		lz77->dists = realloc(lz77->dists, capacity * sizeof(uint16_t));
+		if (lz77->litlens == NULL || lz77->dists == NULL) {
+			fatal("no memory");
+		}
+	}
+}
+
+void lz77_push(struct lz77 *lz77, int litlen, int dist)
+{
+	if (lz77->count == lz77->capacity) {
+		lz77_reserve(lz77, lz77->capacity ? lz77->capacity * 2 : 1024);
+	}
+	lz77->litlens[lz77->count] = litlen;
+	lz77->dists[lz77->count] = dist;
+	lz77->count++;
+}
+
+void lz77_free(struct lz77 *lz77)
+{
+	free(lz77->litlens);
+	free(lz77->dists);
+	*lz77 = (struct lz77) {0};
+}
+
+/// Symbol frequencies of a range of lz77 symbols, including one end-of-block symbol.
+struct histogram {
+	size_t litlens[LITLEN_CODES];
+	size_t dists[DIST_CODES];
+};
+
+void lz77_histogram(struct lz77 const *lz77, size_t begin, size_t end, struct histogram *histogram)
+{
+	memset(histogram, 0, sizeof(*histogram));
+	for (size_t i = begin; i < end; ++i) {
+		if (lz77->dists[i] == 0) {
+			histogram->litlens[lz77->litlens[i]]++;
+		} else {
+			histogram->litlens[257 + length_code(lz77->litlens[i])]++;
+			histogram->dists[dist_code(lz77->dists[i])]++;
+		}
+	}
+	histogram->litlens[END_OF_BLOCK]++;
+}
+
+/// Symbol with its frequency, used to sort symbols while building Huffman codes.
+struct symbol_freq {
+	size_t freq;
+	int symbol;
+};
+
+int compare_symbol_freq(void const *a, void const *b)
+{
+	struct symbol_freq const *x = a, *y = b;
+	if (x->freq != y->freq) {
+		return x->freq < y->freq ? -1 : 1;
+	}
+	return x->symbol - y->symbol;
+}
+
+/// Computes the lengths of a Huffman code for 'n' symbols with the given frequencies, so that no
+/// code is longer than 'max_bits'. At least two symbols always get a code, because some decoders
+/// reject codes that are not complete.
+void huffman_lengths(size_t const *freqs, int n, int max_bits, unsigned char *lengths)
+{
+	struct symbol_freq syms[LITLEN_CODES];
+	int used = 0;
+	for (int i = 0; i < n; ++i) {
+		lengths[i] = 0;
+		if (freqs[i] > 0) {
+			syms[used++] = (struct symbol_freq) {freqs[i], i};
+		}
+	}
+	if (used < 2) {
+		int other = used == 1 && syms[0].symbol == 0 ? 1 : 0;
+		lengths[other] = 1;
+		lengths[used == 1 ? syms[0].symbol : 1 - other] = 1;
+		return;
+	}
+	qsort(syms, used, sizeof(syms[0]), compare_symbol_freq);
+
+	// Minimum-redundancy code lengths computed in place, see "In-Place Calculation of
+	// Minimum-Redundancy Codes" by Moffat and Katajainen. Afterwards syms[i].freq is the code length
+	// of syms[i], which is never shorter than that of a more frequent symbol.
+	syms[0].freq += syms[1].freq;
+	int root = 0, leaf = 2;
+	for (int next = 1; next < used - 1; ++next) {
+		if (leaf >= used || syms[root].freq < syms[leaf].freq) {
+			syms[next].freq = syms[root].freq;
+			syms[root++].freq = next;
+		} else {
+			syms[next].freq = syms[leaf++].freq;
+		}
+		if (leaf >= used || (root < next && syms[root].freq < syms[leaf].freq)) {
+			syms[next].freq += syms[root].freq;
+			syms[root++].freq = next;
+		} else {
+			syms[next].freq += syms[leaf++].freq;
+		}
+	}
+	syms[used - 2].freq = 0;
+	for (int next = used - 3; next >= 0; --next) {
+		syms[next].freq = syms[syms[next].freq].freq + 1;
+	}
+	int avail = 1, depth = 0, next = used - 1;
+	root = used - 2;
+	while (avail > 0) {
+		int nodes = 0;
+		while (root >= 0 && (int) syms[root].freq == depth) {
+			++nodes;
+			--root;
+		}
+		while (avail > nodes) {
+			syms[next--].freq = depth;
+			--avail;
+		}
+		avail = 2 * nodes;
+		++depth;
+	}
+
+	// Limit the code lengths by moving leaves up from the bottom of the tree until the Kraft sum
+	// is exactly one again.
+	int count[64] = {0};
+	for (int i = 0; i < used; ++i) {
+		count[syms[i].freq < (size_t) max_bits ? syms[i].freq : (size_t) max_bits]++;
+	}
+	uint32_t total = 0;
+	for (int bits = max_bits; bits > 0; --bits) {
+		total += (uint32_t) count[bits] << (max_bits - bits);
+	}
+	while (total != 1u << max_bits) {
+		count[max_bits]--;
+		for (int bits = max_bits - 1; bits > 0; --bits) {
+			if (count[bits] > 0) {
+				count[bits]--;
+				count[bits + 1] += 2;
+				break;
+			}
+		}
+		--total;
+	}
+	// The most frequent symbols, at the end of 'syms', get the shortest codes.
+	int j = used;
+	for (int bits = 1; bits <= max_bits; ++bits) {
+		for (int k = count[bits]; k > 0; --k) {
+			lengths[syms[--j].symbol] = bits;
+		}
+	}
+}
+
+/// Computes the canonical codes for the given code lengths, bit-reversed for the LSB-first
+/// deflate bit order.
+void huffman_codes(unsigned char const *lengths, int n, uint16_t *codes)
+{
+	int count[MAX_CODE_BITS + 1] = {0};
+	int next[MAX_CODE_BITS + 1];
+	for (int i = 0; i < n; ++i) {
+		count[lengths[i]]++;
+	}
+	count[0] = 0;
+	int code = 0;
+	for (int bits = 1; bits <= MAX_CODE_BITS; ++bits) {
+		code = (code + count[bits - 1]) << 1;
+		next[bits] = code;
+	}
+	for (int i = 0; i < n; ++i) {
+		if (lengths[i] > 0) {
+			int c = next[lengths[i]]++, reversed = 0;
+			for (int b = 0; b < lengths[i]; ++b) {
+				reversed = reversed << 1 | ((c >> b) & 1);
+			}
+			codes[i] = reversed;
+		}
+	}
+}
+
+/// Appends bits to a growing buffer, least significant bit first.
+struct bit_writer {
+	unsigned char *data;
+	size_t size;
+	size_t capacity;
+	uint64_t bits;
+	int bit_count;
+};
+
+void put_byte(struct bit_writer *w, unsigned char byte)
+{
+	if (w->size == w->capacity) {
+		w->capacity = w->capacity ? w->capacity * 2 : 1 << 16;
+		if ((w->data = realloc(w->data, w->capacity)) == NULL) {
+			fatal("no memory");
+		}
+	}
+	w->data[w->size++] = byte;
+}
+
+void put_bits(struct bit_writer *w, uint32_t value, int count)
+{
+	w->bits |= (uint64_t) value << w->bit_count;
+	w->bit_count += count;
+	while (w->bit_count >= 8) {
+		put_byte(w, w->bits);
+		w->bits >>= 8;
+		w->bit_count -= 8;
+	}
+}
+
+/// Pads the output with zero bits up to the next byte boundary.
+void align_to_byte(struct bit_writer *w)
+{
+	if (w->bit_count > 0) {
+		put_bits(w, 0, 8 - w->bit_count);
+	}
+}
+
+/// Writes the code lengths of a dynamic block header to 'w', which may be NULL. Returns the size
+/// of the header in bits, excluding the three bits of the block header.
+size_t encode_tree(struct bit_writer *w, unsigned char const *ll_lengths, unsigned char const *d_lengths)
+{
+	int hlit = LITLEN_CODES, hdist = DIST_CODES;
+	while (hlit > 257 && ll_lengths[hlit - 1] == 0) {
+		--hlit;
+	}
+	while (hdist > 1 && d_lengths[hdist - 1] == 0) {
+		--hdist;
+	}
+	unsigned char lengths[LITLEN_CODES + DIST_CODES];
+	memcpy(lengths, ll_lengths, hlit);
+	memcpy(lengths + hlit, d_lengths, hdist);
+	int const n = hlit + hdist;
+
+	// Run-length encode the lengths with the repeat symbols 16 (previous length 3-6 times),
+	// 17 (zero 3-10 times) and 18 (zero 11-138 times).
+	unsigned char symbols[LITLEN_CODES + DIST_CODES];
+	unsigned char extras[LITLEN_CODES + DIST_CODES];
+	int symbol_count = 0;
+	int last = -1;
+	for (int i = 0; i < n;) {
+		int v = lengths[i], run = 1;
+		while (i + run < n && lengths[i + run] == v) {
+			++run;
+		}
+		if (v == 0 && run >= 3) {
+			int r = run > 138 ? 138 : run;
+			symbols[symbol_count] = r >= 11 ? 18 : 17;
+			extras[symbol_count++] = r >= 11 ? r - 11 : r - 3;
+			i += r;
+			last = 0;
+		} else if (v == last && run >= 3) {
+			int r = run > 6 ? 6 : run;
+			symbols[symbol_count] = 16;
+			extras[symbol_count++] = r - 3;
+			i += r;
+		} else {
+			symbols[symbol_count] = v;
+			extras[symbol_count++] = 0;
+			last = v;
+			++i;
+		}
+	}
+
+	size_t freqs[CODELEN_CODES] = {0};
+	for (int i = 0; i < symbol_count; ++i) {
+		freqs[symbols[i]]++;
+	}
+	unsigned char cl_lengths[CODELEN_CODES];
+	uint16_t cl_codes[CODELEN_CODES];
+	huffman_lengths(freqs, CODELEN_CODES, MAX_CODELEN_BITS, cl_lengths);
+	huffman_codes(cl_lengths, CODELEN_CODES, cl_codes);
+	int hclen = CODELEN_CODES;
+	while (hclen > 4 && cl_lengths[codelen_order[hclen - 1]] == 0) {
+		--hclen;
+	}
+
+	static unsigned char const repeat_bits[3] = {2, 3, 7};
+	size_t bits = 5 + 5 + 4 + 3 * hclen;
+	for (int i = 0; i < symbol_count; ++i) {
+		bits += cl_lengths[symbols[i]] + (symbols[i] >= 16 ? repeat_bits[symbols[i] - 16] : 0);
+	}
+	if (w != NULL) {
+		put_bits(w, hlit - 257, 5);
+		put_bits(w, hdist - 1, 5);
+		put_bits(w, hclen - 4, 4);
+		for (int i = 0; i < hclen; ++i) {
+			put_bits(w, cl_lengths[codelen_order[i]], 3);
+		}
+		for (int i = 0; i < symbol_count; ++i) {
+			put_bits(w, cl_codes[symbols[i]], cl_lengths[symbols[i]]);
+			if (symbols[i] >= 16) {
+				put_bits(w, extras[i], repeat_bits[symbols[i] - 16]);
+			}
+		}
+	}
+	return bits;
+}
+
+/// Fills in the code lengths of the fixed Huffman codes.
+void fixed_lengths(unsigned char *ll_lengths, unsigned char *d_lengths)
+{
+	for (int i = 0; i < FIXED_LITLEN_CODES; ++i) {
+		ll_lengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+	}
+	memset(d_lengths, 5, DIST_CODES);
+}
+
+/// Returns the size in bits of the symbols in 'histogram' with the given code lengths.
+size_t data_bits(struct histogram const *histogram, unsigned char const *ll_lengths,
+		unsigned char const *d_lengths)
+{
+	size_t bits = 0;
+	for (int i = 0; i < LITLEN_CODES; ++i) {
+		bits += histogram->litlens[i] * (ll_lengths[i] + (i > 256 ? length_extra[i - 257] : 0));
+	}
+	for (int i = 0; i < DIST_CODES; ++i) {
+		bits += histogram->dists[i] * (d_lengths[i] + dist_extra[i]);
+	}
+	return bits;
+}
+
+/// Returns the size in bits of the symbols [begin, end) as a block with fixed or dynamic codes,
+/// whichever is smaller. 'dynamic' receives whether the dynamic codes won.
+size_t block_bits(struct lz77 const *lz77, size_t begin, size_t end, bool *dynamic)
+{
+	struct histogram histogram;
+	unsigned char ll_lengths[FIXED_LITLEN_CODES], d_lengths[DIST_CODES];
+	lz77_histogram(lz77, begin, end, &histogram);
+
+	fixed_lengths(ll_lengths, d_lengths);
+	size_t fixed = 3 + data_bits(&histogram, ll_lengths, d_lengths);
+	huffman_lengths(histogram.litlens, LITLEN_CODES, MAX_CODE_BITS, ll_lengths);
+	huffman_lengths(histogram.dists, DIST_CODES, MAX_CODE_BITS, d_lengths);
+	size_t dynamic_size = 3 + encode_tree(NULL, ll_lengths, d_lengths)
+			+ data_bits(&histogram, ll_lengths, d_lengths);
+	if (dynamic != NULL) {
+		*dynamic = dynamic_size < fixed;
+	}
+	return dynamic_size < fixed ? dynamic_size : fixed;
+}
+
+/// Estimated cost in bits of every symbol, used by the optimal parser.
+struct cost_model {
+	double literal[256];
+	double length[MAX_MATCH + 1]; // Including the extra bits.
+	double dist[DIST_CODES]; // Including the extra bits.
+};
+
+/// Initializes 'model' with the sizes of the fixed Huffman codes.
+void fixed_cost_model(struct cost_model *model)
+{
+	for (int i = 0; i < 256; ++i) {
+		model->literal[i] = i < 144 ? 8 : 9;
+	}
+	for (int len = MIN_MATCH; len <= MAX_MATCH; ++len) {
+		int code = length_code(len);
+		model->length[len] = (code < 24 ? 7 : 8) + length_extra[code];
+	}
+	for (int i = 0; i < DIST_CODES; ++i) {
+		model->dist[i] = 5 + dist_extra[i];
+	}
+}
+
+/// Returns the entropy of every symbol in bits. Unused symbols are as expensive as a symbol that
+/// occurs once.
+void entropy(size_t const *freqs, int n, double *bits)
+{
+	size_t sum = 0;
+	for (int i = 0; i < n; ++i) {
+		sum += freqs[i];
+	}
+	double log2sum = log2(sum > 0 ? (double) sum : (double) n);
+	for (int i = 0; i < n; ++i) {
+		bits[i] = freqs[i] > 0 ? log2sum - log2((double) freqs[i]) : log2sum;
+	}
+}
+
+/// Initializes 'model' from the symbol statistics of a previous parse.
+void statistics_cost_model(struct cost_model *model, struct histogram const *histogram)
+{
+	double ll_bits[LITLEN_CODES], d_bits[DIST_CODES];
+	entropy(histogram->litlens, LITLEN_CODES, ll_bits);
+	entropy(histogram->dists, DIST_CODES, d_bits);
+	memcpy(model->literal, ll_bits, sizeof(model->literal));
+	for (int len = MIN_MATCH; len <= MAX_MATCH; ++len) {
+		int code = length_code(len);
+		model->length[len] = ll_bits[257 + code] + length_extra[code];
+	}
+	for (int i = 0; i < DIST_CODES; ++i) {
+		model->dist[i] = d_bits[i] + dist_extra[i];
+	}
+}
+
+/// A part of the input that is compressed on its own thread.
+struct band {
+	unsigned char const *data;
+	size_t size;
+	size_t history; // Bytes before 'data' that matches may refer to.
+	int iterations;
+	struct lz77 lz77; // Result: the symbols of the band.
+	size_t bounds[MAX_BLOCKS + 1]; // Result: blocks are the symbols [bounds[i], bounds[i + 1]).
+	int block_count;
+	uint32_t adler; // Result: the Adler-32 checksum of the band alone.
+};
+
+/// Matches found at every position of a band. For position i, pairs[starts[i]] to
+/// pairs[starts[i + 1] - 1] have strictly increasing lengths and distances, and each is the closest
+/// match of its length, so that every length up to the longest can use the closest distance.
+struct match_table {
+	size_t *starts;
+	uint16_t (*pairs)[2]; // {length, distance}
+	size_t capacity;
+};
+
+/// Returns the number of equal bytes at 'a' and 'b', at most 'limit'.
+size_t match_length(unsigned char const *a, unsigned char const *b, size_t limit)
+{
+	size_t len = 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	// Compare eight bytes at a time. The lowest differing byte is the first one in memory.
+	while (len + 8 <= limit) {
+		uint64_t x, y;
+		memcpy(&x, a + len, 8);
+		memcpy(&y, b + len, 8);
+		if (x != y) {
+			return len + (__builtin_ctzll(x ^ y) >> 3);
+		}
+		len += 8;
+	}
+#endif
+	while (len < limit && a[len] == b[len]) {
+		++len;
+	}
+	return len;
+}
+
+uint32_t hash3(unsigned char const *p)
+{
+	return ((p[0] << 10) ^ (p[1] << 5) ^ p[2]) & (HASH_SIZE - 1);
+}
+
+/// Fills 'table' with the matches of every position of the band using hash chains.
+/// @param same same[i] is the number of bytes from band->data[i - band->history] on that are equal
+///             to it. Runs of one byte are skipped with it instead of being compared.
+void find_matches(struct band const *band, uint32_t const *same, struct match_table *table)
+{
+	unsigned char const *base = band->data - band->history;
+	size_t const total = band->history + band->size;
+	int32_t *head = xmalloc(HASH_SIZE * sizeof(int32_t));
+	int32_t *prev = xmalloc(total * sizeof(int32_t));
+	for (size_t i = 0; i < HASH_SIZE; ++i) {
+		head[i] = -1;
+	}
+	table->starts = xmalloc((band->size + 1) * sizeof(size_t));
+	table->capacity = band->size + 16;
+	table->pairs = xmalloc(table->capacity * sizeof(table->pairs[0]));
+
+	size_t count = 0;
+	for (size_t p = 0; p < total; ++p) {
+		if (p >= band->history) {
+			table->starts[p - band->history] = count;
+		}
+		if (p + MIN_MATCH > total) {
+			continue;
+		}
+		uint32_t h = hash3(base + p);
+		if (p >= band->history) {
+			size_t const max_len = total - p < MAX_MATCH ? total - p : MAX_MATCH;
+			size_t best = MIN_MATCH - 1;
+			size_t const first = count;
+			int chain = MAX_CHAIN;
+			for (int32_t c = head[h]; c >= 0 && p - c <= WINDOW_SIZE && chain-- > 0; c = prev[c]) {
+				if (base[c + best] != base[p + best]) {
+					continue;
+				}
+				size_t len = 0;
+				if (base[c] == base[p]) {
+					len = same[p] < same[c] ? same[p] : same[c];
+					len = len < max_len ? len : max_len;
+				}
+				len += match_length(base + c + len, base + p + len, max_len - len);
+				if (len <= best) {
+					continue;
+				}
+				if (count == table->capacity) {
+					table->capacity *= 2;
+					table->pairs = realloc(table->pairs, table->capacity * sizeof(table->pairs[0]));
+					if (table->pairs == NULL) {
+						fatal("no memory");
+					}
+				}
+				// Keep the longest match when there are too many, the others are closer to it.
+				if (count - first == MAX_PAIRS) {
+					--count;
+				}
+				table->pairs[count][0] = len;
+				table->pairs[count][1] = p - c;
+				++count;
+				best = len;
+				if (len == max_len || len >= NICE_LENGTH) {
+					break;
+				}
+			}
+		}
+		prev[p] = head[h];
+		head[h] = p;
+	}
+	table->starts[band->size] = count;
+	free(head);
+	free(prev);
+}
+
+/// Finds the cheapest parse of the band under 'model' and stores it in 'lz77'.
+void optimal_parse(struct band const *band, struct match_table const *table, uint32_t const *same,
+		struct cost_model const *model, struct lz77 *lz77)
+{
+	size_t const n = band->size;
+	double *cost = xmalloc((n + 1) * sizeof(double));
+	uint16_t *from_len = xmalloc((n + 1) * sizeof(uint16_t));
+	uint16_t *from_dist = xmalloc((n + 1) * sizeof(uint16_t));
+	cost[0] = 0;
+	for (size_t i = 1; i <= n; ++i) {
+		cost[i] = INFINITY;
+	}
+
+	for (size_t i = 0; i < n; ++i) {
+		// Inside long runs of one byte, the best choice is always a maximum length match one byte
+		// back. Skip ahead like zopfli does instead of trying every length at every position.
+		if (same[i] > MAX_MATCH * 2 && i > MAX_MATCH + 1 && same[i - MAX_MATCH] > MAX_MATCH) {
+			double symbol_cost = model->length[MAX_MATCH] + model->dist[0];
+			for (int k = 0; k < MAX_MATCH; ++k, ++i) {
+				cost[i + MAX_MATCH] = cost[i] + symbol_cost;
+				from_len[i + MAX_MATCH] = MAX_MATCH;
+				from_dist[i + MAX_MATCH] = 1;
+			}
+		}
+
+		double c = cost[i] + model->literal[band->data[i]];
+		if (c < cost[i + 1]) {
+			cost[i + 1] = c;
+			from_len[i + 1] = 1;
+			from_dist[i + 1] = 0;
+		}
+		size_t len = MIN_MATCH;
+		for (size_t k = table->starts[i]; k < table->starts[i + 1]; ++k) {
+			size_t const max_len = table->pairs[k][0], dist = table->pairs[k][1];
+			double const base_cost = cost[i] + model->dist[dist_code(dist)];
+			for (; len <= max_len; ++len) {
+				c = base_cost + model->length[len];
+				if (c < cost[i + len]) {
+					cost[i + len] = c;
+					from_len[i + len] = len;
+					from_dist[i + len] = dist;
+				}
+			}
+		}
+	}
+
+	// Walk back from the end and emit the symbols in order.
+	size_t count = 0;
+	for (size_t i = n; i > 0; i -= from_len[i]) {
+		++count;
+	}
+	lz77_reserve(lz77, count);
+	lz77->count = count;
+	for (size_t i = n; i > 0; i -= from_len[i]) {
+		--count;
+		if (from_dist[i] == 0) {
+			lz77->litlens[count] = band->data[i - 1];
+			lz77->dists[count] = 0;
+		} else {
+			lz77->litlens[count] = from_len[i];
+			lz77->dists[count] = from_dist[i];
+		}
+	}
+	free(cost);
+	free(from_len);
+	free(from_dist);
+}
+
+/// Finds the split point p of the symbols [begin, end) that minimizes the size of the blocks
+/// [begin, p) and [p, end), by repeatedly narrowing down the interval around the best of a few
+/// evenly spaced candidates.
+size_t find_split(struct lz77 const *lz77, size_t begin, size_t end, size_t *best_bits)
+{
+	enum {CANDIDATES = 9};
+	size_t lo = begin + 1, hi = end;
+	size_t best = lo, last_bits = SIZE_MAX;
+	while (hi - lo > CANDIDATES) {
+		size_t points[CANDIDATES], bits[CANDIDATES];
+		int best_i = 0;
+		for (int i = 0; i < CANDIDATES; ++i) {
+			points[i] = lo + (i + 1) * (hi - lo) / (CANDIDATES + 1);
+			bits[i] = block_bits(lz77, begin, points[i], NULL) + block_bits(lz77, points[i], end, NULL);
+			if (bits[i] < bits[best_i]) {
+				best_i = i;
+			}
+		}
+		if (bits[best_i] > last_bits) {
+			break;
+		}
+		lo = best_i == 0 ? lo : points[best_i - 1];
+		hi = best_i == CANDIDATES - 1 ? hi : points[best_i + 1];
+		best = points[best_i];
+		last_bits = bits[best_i];
+	}
+	*best_bits = last_bits;
+	return best;
+}
+
+/// Splits the symbols of the band into blocks wherever new Huffman codes make the result smaller.
+/// The largest block that may still be split is always tried next.
+void split_blocks(struct band *band)
+{
+	bool done[MAX_BLOCKS] = {0};
+	band->bounds[0] = 0;
+	band->bounds[1] = band->lz77.count;
+	band->block_count = 1;
+	while (band->block_count < MAX_BLOCKS) {
+		int largest = -1;
+		for (int i = 0; i < band->block_count; ++i) {
+			size_t size = band->bounds[i + 1] - band->bounds[i];
+			if (!done[i] && size >= 16
+					&& (largest < 0 || size > band->bounds[largest + 1] - band->bounds[largest])) {
+				largest = i;
+			}
+		}
+		if (largest < 0) {
+			break;
+		}
+		size_t begin = band->bounds[largest], end = band->bounds[largest + 1];
+		size_t split_bits;
+		size_t split = find_split(&band->lz77, begin, end, &split_bits);
+		if (split_bits >= block_bits(&band->lz77, begin, end, NULL)) {
+			done[largest] = true;
+			continue;
+		}
+		memmove(&band->bounds[largest + 2], &band->bounds[largest + 1],
+				(band->block_count - largest) * sizeof(band->bounds[0]));
+		memmove(&done[largest + 1], &done[largest], (band->block_count - largest) * sizeof(done[0]));
+		band->bounds[largest + 1] = split;
+		done[largest] = done[largest + 1] = false;
+		band->block_count++;
+	}
+}
+
+/// Parses the band several times, each time with the costs of the symbols of the best parse so
+/// far, and splits the best parse into blocks.
+void compress_band(struct band *band)
+{
+	// same[i] is the number of bytes from position i of the history and the band on that are equal
+	// to the byte at i.
+	unsigned char const *base = band->data - band->history;
+	size_t const total = band->history + band->size;
+	uint32_t *same = xmalloc((total + 1) * sizeof(uint32_t));
+	same[total] = 0;
+	for (size_t i = total; i-- > 0;) {
+		bool run = i + 1 < total && base[i + 1] == base[i];
+		same[i] = run ? same[i + 1] + 1 : 1;
+	}
+	struct match_table table;
+	find_matches(band, same, &table);
+
+	struct cost_model model;
+	fixed_cost_model(&model);
+	struct lz77 current = {0};
+	size_t best_bits = SIZE_MAX;
+	for (int i = 0; i < band->iterations; ++i) {
+		optimal_parse(band, &table, same + band->history, &model, &current);
+		struct histogram histogram;
+		lz77_histogram(&current, 0, current.count, &histogram);
+		size_t bits = block_bits(&current, 0, current.count, NULL);
+		if (bits < best_bits) {
+			best_bits = bits;
+			struct lz77 swap = band->lz77;
+			band->lz77 = current;
+			current = swap;
+		}
+		statistics_cost_model(&model, &histogram);
+	}
+	lz77_free(&current);
+	free(same);
+	free(table.starts);
+	free(table.pairs);
+
+	split_blocks(band);
+}
+
+void compress_bands(void *ctx, size_t begin, size_t end)
+{
+	struct band *bands = ctx;
+	for (size_t i = begin; i < end; ++i) {
+		bands[i].adler = adler32_update(1, bands[i].data, bands[i].size);
+		compress_band(&bands[i]);
+	}
+}
+
+/// Writes the symbols [begin, end) as one Huffman coded block.
+void write_block(struct bit_writer *w, struct lz77 const *lz77, size_t begin, size_t end,
+		bool dynamic, bool final)
+{
+	unsigned char ll_lengths[FIXED_LITLEN_CODES] = {0}, d_lengths[DIST_CODES];
+	uint16_t ll_codes[FIXED_LITLEN_CODES], d_codes[DIST_CODES];
+	put_bits(w, final, 1);
+	put_bits(w, dynamic ? 2 : 1, 2);
+	if (dynamic) {
+		struct histogram histogram;
+		lz77_histogram(lz77, begin, end, &histogram);
+		huffman_lengths(histogram.litlens, LITLEN_CODES, MAX_CODE_BITS, ll_lengths);
+		huffman_lengths(histogram.dists, DIST_CODES, MAX_CODE_BITS, d_lengths);
+		encode_tree(w, ll_lengths, d_lengths);
+	} else {
+		fixed_lengths(ll_lengths, d_lengths);
+	}
+	huffman_codes(ll_lengths, FIXED_LITLEN_CODES, ll_codes);
+	huffman_codes(d_lengths, DIST_CODES, d_codes);
+
+	for (size_t i = begin; i < end; ++i) {
+		int litlen = lz77->litlens[i], dist = lz77->dists[i];
+		if (dist == 0) {
+			put_bits(w, ll_codes[litlen], ll_lengths[litlen]);
+			continue;
+		}
+		int lc = length_code(litlen), dc = dist_code(dist);
+		put_bits(w, ll_codes[257 + lc], ll_lengths[257 + lc]);
+		put_bits(w, litlen - length_base[lc], length_extra[lc]);
+		put_bits(w, d_codes[dc], d_lengths[dc]);
+		put_bits(w, dist - dist_base[dc], dist_extra[dc]);
+	}
+	put_bits(w, ll_codes[END_OF_BLOCK], ll_lengths[END_OF_BLOCK]);
+}
+
+/// Writes 'size' bytes of 'data' as stored blocks.
+void write_stored(struct bit_writer *w, unsigned char const *data, size_t size, bool final)
+{
+	do {
+		size_t len = size < 65535 ? size : 65535;
+		put_bits(w, final && len == size, 1);
+		put_bits(w, 0, 2);
+		align_to_byte(w);
+		put_bits(w, len, 16);
+		put_bits(w, ~len & 0xffff, 16);
+		for (size_t i = 0; i < len; ++i) {
+			put_byte(w, data[i]);
+		}
+		data += len;
+		size -= len;
+	} while (size > 0);
+}
+
+unsigned char *zlib_compress_optimal(unsigned char const *data, size_t size, size_t *out_size,
+		int iterations)
+{
+	size_t const band_count = size > 0 ? (size + BAND_SIZE - 1) / BAND_SIZE : 1;
+	struct band *bands = xmalloc(band_count * sizeof(struct band));
+	for (size_t i = 0; i < band_count; ++i) {
+		size_t begin = i * BAND_SIZE;
+		bands[i] = (struct band) {
+				.data = data + begin,
+				.size = size - begin < BAND_SIZE ? size - begin : BAND_SIZE,
+				.history = begin < WINDOW_SIZE ? begin : WINDOW_SIZE,
+				.iterations = iterations > 0 ? iterations : 1,
+		};
+	}
+	parallel_for(band_count, compress_bands, bands);
+
+	struct bit_writer w = {0};
+	put_byte(&w, 0x78); // Deflate with a 32K window
+	put_byte(&w, 0xda); // Maximum compression
+	for (size_t i = 0; i < band_count; ++i) {
+		struct band *band = &bands[i];
+		unsigned char const *block_data = band->data;
+		for (int b = 0; b < band->block_count; ++b) {
+			size_t begin = band->bounds[b], end = band->bounds[b + 1];
+			size_t block_size = 0;
+			for (size_t k = begin; k < end; ++k) {
+				block_size += band->lz77.dists[k] == 0 ? 1 : band->lz77.litlens[k];
+			}
+			bool final = i == band_count - 1 && b == band->block_count - 1;
+			bool dynamic;
+			size_t bits = block_bits(&band->lz77, begin, end, &dynamic);
+			size_t stored_bits = (block_size + (block_size / 65535 + 1) * 5) * 8;
+			if (stored_bits < bits) {
+				write_stored(&w, block_data, block_size, final);
+			} else {
+				write_block(&w, &band->lz77, begin, end, dynamic, final);
+			}
+			block_data += block_size;
+		}
+		lz77_free(&band->lz77);
+	}
+	align_to_byte(&w);
+	uint32_t checksum = bands[0].adler;
+	for (size_t i = 1; i < band_count; ++i) {
+		checksum = adler32_combine(checksum, bands[i].adler, bands[i].size);
+	}
+	for (int shift = 24; shift >= 0; shift -= 8) {
+		put_byte(&w, checksum >> shift);
+	}
+	free(bands);
+	*out_size = w.size;
+	return w.data;
+}
+
+/// Input is collected in 'buffer', which keeps at least WINDOW_SIZE bytes before the current
+/// position for matches and slides down when it is full. The symbols of the current block are
+/// written out every STREAM_BLOCK_SIZE symbols.
+struct deflate_stream {
+	enum deflate_strategy strategy;
+	int max_chain;
+	deflate_write_func *write;
+	void *context;
+	unsigned char *buffer;
+	size_t pos; // Next position of the buffer to parse.
+	size_t end; // Bytes in the buffer.
+	int32_t *head; // Last position of the buffer with every hash, or -1.
+	int32_t *prev; // Previous position of the buffer with the same hash, or -1.
+	size_t prev_len; // Match at pos - 1 that waits for lazy matching, or 0.
+	size_t prev_dist;
+	bool pending; // Whether the byte at pos - 1 is not encoded yet.
+	struct lz77 block;
+	struct bit_writer out;
+	uint32_t adler;
+};
+
+struct deflate_stream *deflate_open(enum deflate_strategy strategy, int level, deflate_write_func *write,
+		void *context)
+{
+	if (strategy == DEFLATE_OPTIMAL) {
+		fatal("optimal parsing cannot be streamed");
+	}
+	struct deflate_stream *s = xmalloc(sizeof(*s));
+	*s = (struct deflate_stream) {
+			.strategy = strategy,
+			.max_chain = level > 0 ? 2 * level : 1,
+			.write = write,
+			.context = context,
+			.buffer = xmalloc(STREAM_BUFFER_SIZE),
+			.adler = 1,
+	};
+	if (strategy == DEFLATE_SEARCH) {
+		s->head = xmalloc(HASH_SIZE * sizeof(int32_t));
+		s->prev = xmalloc(STREAM_BUFFER_SIZE * sizeof(int32_t));
+		memset(s->head, -1, HASH_SIZE * sizeof(int32_t));
+		memset(s->prev, -1, STREAM_BUFFER_SIZE * sizeof(int32_t));
+	}
+	lz77_reserve(&s->block, STREAM_BLOCK_SIZE);
+	put_byte(&s->out, 0x78); // Deflate with a 32K window
+	put_byte(&s->out, 0x9c); // Default compression
+	return s;
+}
+
+/// Writes the symbols collected so far as one block and passes all whole bytes on.
+void flush_stream_block(struct deflate_stream *s, bool final)
+{
+	bool dynamic;
+	block_bits(&s->block, 0, s->block.count, &dynamic);
+	write_block(&s->out, &s->block, 0, s->block.count, dynamic, final);
+	s->block.count = 0;
+	if (final) {
+		align_to_byte(&s->out);
+		for (int shift = 24; shift >= 0; shift -= 8) {
+			put_byte(&s->out, s->adler >> shift);
+		}
+	}
+	s->write(s->context, s->out.data, s->out.size);
+	s->out.size = 0;
+}
+
+void push_stream_symbol(struct deflate_stream *s, int litlen, int dist)
+{
+	lz77_push(&s->block, litlen, dist);
+	if (s->block.count == STREAM_BLOCK_SIZE) {
+		flush_stream_block(s, false);
+	}
+}
+
+/// Adds position p of the buffer to the hash chains.
+void insert_stream_hash(struct deflate_stream *s, size_t p)
+{
+	if (p + MIN_MATCH <= s->end) {
+		uint32_t h = hash3(s->buffer + p);
+		s->prev[p] = s->head[h];
+		s->head[h] = p;
+	}
+}
+
+/// Returns the length of the longest match at position p of the buffer, or 0 if there is none.
+size_t find_stream_match(struct deflate_stream const *s, size_t p, size_t *dist)
+{
+	size_t const limit = s->end - p < MAX_MATCH ? s->end - p : MAX_MATCH;
+	if (limit < MIN_MATCH) {
+		return 0;
+	}
+	unsigned char const *buffer = s->buffer;
+	size_t best = MIN_MATCH - 1;
+	int chain = s->max_chain;
+	for (int32_t c = s->head[hash3(buffer + p)]; c >= 0 && p - c <= WINDOW_SIZE && chain-- > 0;
+			c = s->prev[c]) {
+		if (buffer[c + best] != buffer[p + best]) {
+			continue;
+		}
+		size_t len = match_length(buffer + c, buffer + p, limit);
+		if (len > best) {
+			best = len;
+			*dist = p - c;
+			if (len == limit || len >= NICE_LENGTH) {
+				break;
+			}
+		}
+	}
+	return best >= MIN_MATCH ? best : 0;
+}
+
+/// Encodes the buffer up to the point where matches could still grow with more input, or up to
+/// its end if 'final' is set.
+void parse_stream(struct deflate_stream *s, bool final)
+{
+	size_t const stop = final ? s->end : s->end > MAX_MATCH ? s->end - MAX_MATCH : 0;
+	unsigned char const *buffer = s->buffer;
+	while (s->pos < stop) {
+		size_t const p = s->pos;
+		if (s->strategy == DEFLATE_HUFFMAN) {
+			push_stream_symbol(s, buffer[p], 0);
+			s->pos++;
+			continue;
+		}
+		if (s->strategy == DEFLATE_RLE) {
+			size_t const limit = s->end - p < MAX_MATCH ? s->end - p : MAX_MATCH;
+			size_t len = p > 0 ? match_length(buffer + p - 1, buffer + p, limit) : 0;
+			if (len >= MIN_MATCH) {
+				push_stream_symbol(s, len, 1);
+				s->pos += len;
+			} else {
+				push_stream_symbol(s, buffer[p], 0);
+				s->pos++;
+			}
+			continue;
+		}
+
+		// Lazy matching: the match at p - 1 is only taken if the one at p is not longer.
+		size_t dist = 0;
+		size_t len = s->prev_len < NICE_LENGTH ? find_stream_match(s, p, &dist) : 0;
+		insert_stream_hash(s, p);
+		if (s->prev_len >= MIN_MATCH && len <= s->prev_len) {
+			push_stream_symbol(s, s->prev_len, s->prev_dist);
+			size_t const next = p - 1 + s->prev_len;
+			for (size_t q = p + 1; q < next; ++q) {
+				insert_stream_hash(s, q);
+			}
+			s->pos = next;
+			s->prev_len = 0;
+			s->pending = false;
+		} else {
+			if (s->pending) {
+				push_stream_symbol(s, buffer[p - 1], 0);
+			}
+			s->pending = true;
+			s->prev_len = len;
+			s->prev_dist = dist;
+			s->pos++;
+		}
+	}
+	if (final && s->pending) {
+		push_stream_symbol(s, buffer[s->pos - 1], 0);
+		s->pending = false;
+	}
+}
+
+/// Moves the last WINDOW_SIZE bytes before the current position to the start of the buffer.
+void slide_stream(struct deflate_stream *s)
+{
+	size_t const shift = s->pos - WINDOW_SIZE;
+	memmove(s->buffer, s->buffer + shift, s->end - shift);
+	if (s->strategy == DEFLATE_SEARCH) {
+		for (size_t i = 0; i < HASH_SIZE; ++i) {
+			s->head[i] = s->head[i] >= (int32_t) shift ? s->head[i] - (int32_t) shift : -1;
+		}
+		for (size_t i = 0; i < s->end - shift; ++i) {
+			int32_t c = s->prev[i + shift];
+			s->prev[i] = c >= (int32_t) shift ? c - (int32_t) shift : -1;
+		}
+	}
+	s->pos -= shift;
+	s->end -= shift;
+}
+
+void deflate_write(struct deflate_stream *s, void const *data, size_t size)
+{
+	unsigned char const *bytes = data;
+	s->adler = adler32_update(s->adler, data, size);
+	while (size > 0) {
+		if (s->end == STREAM_BUFFER_SIZE) {
+			slide_stream(s);
+		}
+		size_t n = STREAM_BUFFER_SIZE - s->end < size ? STREAM_BUFFER_SIZE - s->end : size;
+		memcpy(s->buffer + s->end, bytes, n);
+		s->end += n;
+		bytes += n;
+		size -= n;
+		parse_stream(s, false);
+	}
+}
+
+void deflate_close(struct deflate_stream *s)
+{
+	parse_stream(s, true);
+	flush_stream_block(s, true);
+	lz77_free(&s->block);
+	free(s->out.data);
+	free(s->buffer);
+	free(s->head);
+	free(s->prev);
+	free(s);
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2023 Andrey Proskurin (proskur1n)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef DEFLATE_H
+#define DEFLATE_H
+
+#include <stddef.h>
+
+/// Input bytes per band of zlib_compress_optimal, which compresses the bands in parallel. Fixed, so
+/// that the output does not depend on the number of threads.
+#define DEFLATE_BAND_SIZE (1 << 20)
+
+enum deflate_strategy {
+	DEFLATE_OPTIMAL, // Optimal parsing, see zlib_compress_optimal.
+	DEFLATE_SEARCH, // Hash chain search with lazy matching, like zlib's default strategy.
+	DEFLATE_RLE, // Only matches one byte back, that is runs of one byte, like zlib's Z_RLE.
+	DEFLATE_HUFFMAN, // Literals only, like zlib's Z_HUFFMAN_ONLY.
+};
+
+/// Compresses 'size' bytes of 'data' into a zlib stream in the spirit of zopfli: matches are chosen
+/// by optimal parsing against a cost model that is refined over 'iterations' passes, and the
+/// result is split into blocks wherever new Huffman trees pay off. The input is cut into bands
+/// that are compressed by parallel threads, each of which can still refer back into the previous
+/// band. This is many times slower than a deflate_stream, but the stream is much smaller.
+/// @param out_size Receives the size of the returned stream, which must be freed by the caller.
+unsigned char *zlib_compress_optimal(unsigned char const *data, size_t size, size_t *out_size,
+		int iterations);
+
+typedef void deflate_write_func(void *context, unsigned char const *data, size_t size);
+
+/// A zlib stream that is compressed as the data comes in, with a fixed amount of memory.
+struct deflate_stream;
+
+/// Starts a zlib stream that passes its output to write(context, ...) as it is produced.
+/// @param strategy Any strategy but DEFLATE_OPTIMAL, which needs all of the data at once.
+/// @param level Search effort of DEFLATE_SEARCH, which follows up to 2 * level hash chain entries.
+struct deflate_stream *deflate_open(enum deflate_strategy strategy, int level, deflate_write_func *write,
+		void *context);
+
+/// Compresses 'size' more bytes of 'data'.
+void deflate_write(struct deflate_stream *stream, void const *data, size_t size);
+
+/// Writes the rest of the stream and frees it.
+void deflate_close(struct deflate_stream *stream);
+
+#endif
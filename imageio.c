@@ -0,0 +1,793 @@
+/*
+ * Copyright (c) 2023 Andrey Proskurin (proskur1n)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "imageio.h"
+#include "qoi.h"
+#include "deflate.h"
+#include "png.h"
+#include "util.h"
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+#pragma GCC diagnostic ignored "-Wunused-but-set-variable"
+#define STB_IMAGE_IMPLEMENTATION
+#define STBI_ONLY_PNG
+#define STBI_ONLY_JPEG
+#define STBI_ONLY_GIF
+#define STBI_FAILURE_USERMSG
+#include "stb_image.h"
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+#pragma GCC diagnostic pop
+
+#define SAMPLE_RUNS 8 // Runs of consecutive rows that PNG_AUTO compresses to choose a strategy.
+#define SAMPLE_ROWS 16 // Rows per run, so that filters and matches see the rows above.
+#define OPTIMAL_SLOWDOWN 10 // PNG_OPTIMAL takes at least this many times as long as PNG_SEARCH.
+
+/// png_write_func that appends to the FILE in 'context'.
+void write_bytes(void *context, void const *data, size_t size)
+{
+	fwrite(data, 1, size, context);
+}
+
+/// deflate_write_func that adds the size of the data to the size_t in 'context'.
+void count_bytes(void *context, unsigned char const *data, size_t size)
+{
+	(void) data;
+	*(size_t *) context += size;
+}
+
+enum deflate_strategy deflate_strategy(enum png_strategy strategy)
+{
+	switch (strategy) {
+	case PNG_RLE:
+		return DEFLATE_RLE;
+	case PNG_HUFFMAN:
+		return DEFLATE_HUFFMAN;
+	case PNG_OPTIMAL:
+		return DEFLATE_OPTIMAL;
+	default:
+		return DEFLATE_SEARCH;
+	}
+}
+
+/// Returns the size of the zlib stream of 'size' bytes of filtered rows.
+size_t compressed_size(unsigned char const *rows, size_t size, enum png_strategy strategy,
+		struct png_settings const *settings)
+{
+	size_t result = 0;
+	if (strategy == PNG_OPTIMAL) {
+		free(zlib_compress_optimal(rows, size, &result, settings->iterations));
+		return result;
+	}
+	struct deflate_stream *stream = deflate_open(deflate_strategy(strategy), settings->level,
+			count_bytes, &result);
+	deflate_write(stream, rows, size);
+	deflate_close(stream);
+	return result;
+}
+
+double seconds_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+/// Chooses the strategy of PNG_AUTO for 'image'.
+enum png_strategy choose_png_strategy(struct png_image const *image, struct png_settings const *settings)
+{
+	if (settings->budget_ms <= 0) {
+		return image->palette != NULL && image->palette_count <= 16 ? PNG_RLE : PNG_SEARCH;
+	}
+
+	// Filter runs of rows from evenly spaced places of the image into the sample.
+	size_t const rows = image->h, row_size = png_row_size(image);
+	size_t runs = rows / SAMPLE_ROWS < SAMPLE_RUNS ? rows / SAMPLE_ROWS : SAMPLE_RUNS;
+	size_t run_rows = SAMPLE_ROWS;
+	if (runs == 0 || runs * SAMPLE_ROWS >= rows) {
+		runs = 1;
+		run_rows = rows;
+	}
+	size_t const sample_size = runs * run_rows * row_size;
+	unsigned char *sample = xmalloc(sample_size);
+	for (size_t i = 0; i < runs; ++i) {
+		size_t first = (rows - run_rows) * i / (runs > 1 ? runs - 1 : 1);
+		for (size_t y = 0; y < run_rows; ++y) {
+			png_filter_row(image, first + y, settings->filter, sample + (i * run_rows + y) * row_size);
+		}
+	}
+	double const scale = (double) rows / (runs * run_rows);
+	size_t const bands = (rows * row_size + DEFLATE_BAND_SIZE - 1) / DEFLATE_BAND_SIZE;
+	size_t const parallel = bands < (size_t) thread_count ? bands : (size_t) thread_count;
+
+	// Strategies from the fastest to the slowest. Only a noticeably smaller output is worth a
+	// slower strategy.
+	static enum png_strategy const candidates[] = {PNG_HUFFMAN, PNG_RLE, PNG_SEARCH, PNG_OPTIMAL};
+	enum png_strategy best = candidates[0];
+	double best_size = INFINITY, last_ms = 0;
+	for (size_t i = 0; i < sizeof(candidates) / sizeof(candidates[0]); ++i) {
+		if (candidates[i] == PNG_OPTIMAL && last_ms * OPTIMAL_SLOWDOWN > settings->budget_ms) {
+			break;
+		}
+		double start = seconds_now();
+		size_t size = compressed_size(sample, sample_size, candidates[i], settings);
+		last_ms = (seconds_now() - start) * 1000 * scale;
+		if (candidates[i] == PNG_OPTIMAL) {
+			last_ms /= parallel > 0 ? parallel : 1;
+		}
+		if (last_ms > settings->budget_ms) {
+			break;
+		}
+		if (size * scale < best_size * 0.99) {
+			best = candidates[i];
+			best_size = size * scale;
+		}
+	}
+	free(sample);
+	return best;
+}
+
+void write_png_image(FILE *file, struct png_image const *image, struct png_settings const *settings)
+{
+	enum png_strategy strategy = settings->strategy;
+	if (strategy == PNG_AUTO) {
+		strategy = choose_png_strategy(image, settings);
+	}
+	int level = strategy == PNG_OPTIMAL ? settings->iterations : settings->level;
+	png_encode(image, deflate_strategy(strategy), level, settings->filter, write_bytes, file);
+}
+
+struct file_data read_file(char const *path)
+{
+	int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		fatal("cannot open '%s': %s", path, strerror(errno));
+	}
+
+	struct file_data file = {0};
+	if (S_ISREG(st.st_mode) && st.st_size > 0) {
+		// The mapping is private and writable, so that images can be quantized in place without
+		// touching the file.
+		file.size = st.st_size;
+		file.data = mmap(NULL, file.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		file.mapped = file.data != MAP_FAILED;
+	}
+	if (!file.mapped) {
+		// Pipes and other special files have to be read.
+		size_t capacity = 1 << 16;
+		file.data = xmalloc(capacity);
+		file.size = 0;
+		ssize_t n;
+		while ((n = read(fd, file.data + file.size, capacity - file.size)) != 0) {
+			if (n < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				fatal("cannot read '%s': %s", path, strerror(errno));
+			}
+			file.size += n;
+			if (file.size == capacity) {
+				capacity *= 2;
+				if ((file.data = realloc(file.data, capacity)) == NULL) {
+					fatal("no memory");
+				}
+			}
+		}
+	}
+	if (fd != STDIN_FILENO) {
+		close(fd);
+	}
+	return file;
+}
+
+void free_file(struct file_data *file)
+{
+	if (file->mapped) {
+		munmap(file->data, file->size);
+	} else {
+		free(file->data);
+	}
+	*file = (struct file_data) {0};
+}
+
+enum format format_from_name(char const *name, enum format fallback)
+{
+	static struct {
+		char const *name;
+		enum format format;
+	} const names[] = {
+			{"png", FORMAT_PNG},
+			{"gif", FORMAT_GIF},
+			{"pnm", FORMAT_PNM},
+			{"ppm", FORMAT_PNM},
+			{"pgm", FORMAT_PNM},
+			{"pam", FORMAT_PAM},
+			{"idx", FORMAT_IDX},
+			{"qoi", FORMAT_QOI},
+			{"tga", FORMAT_TGA},
+			{"bmp", FORMAT_BMP},
+	};
+	char const *dot = strrchr(name, '.');
+	char const *ext = dot != NULL && strchr(dot, '/') == NULL ? dot + 1 : name;
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+		if (strcasecmp(ext, names[i].name) == 0) {
+			return names[i].format;
+		}
+	}
+	return fallback;
+}
+
+bool format_is_indexed(enum format format)
+{
+	return format == FORMAT_GIF || format == FORMAT_IDX || format == FORMAT_TGA || format == FORMAT_BMP;
+}
+
+/// Cursor over a Netpbm header in memory.
+struct pnm_reader {
+	unsigned char const *p;
+	unsigned char const *end;
+};
+
+bool pnm_is_space(int c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+/// Skips whitespace and comments, which run until the end of the line.
+void pnm_skip_space(struct pnm_reader *r)
+{
+	while (r->p < r->end && (pnm_is_space(*r->p) || *r->p == '#')) {
+		if (*r->p == '#') {
+			while (r->p < r->end && *r->p != '\n') {
+				++r->p;
+			}
+		} else {
+			++r->p;
+		}
+	}
+}
+
+/// Reads the next whitespace-delimited word into 'word' and returns false if there is none.
+bool pnm_read_word(struct pnm_reader *r, char *word, size_t size)
+{
+	pnm_skip_space(r);
+	size_t len = 0;
+	while (r->p < r->end && !pnm_is_space(*r->p) && len + 1 < size) {
+		word[len++] = *r->p++;
+	}
+	word[len] = 0;
+	return len > 0;
+}
+
+/// Reads the next unsigned integer of the header and returns -1 on failure.
+int pnm_read_uint(struct pnm_reader *r)
+{
+	pnm_skip_space(r);
+	long n = 0;
+	unsigned char const *start = r->p;
+	while (r->p < r->end && *r->p >= '0' && *r->p <= '9' && n <= INT_MAX) {
+		n = n * 10 + (*r->p++ - '0');
+	}
+	return r->p == start || n > INT_MAX ? -1 : (int) n;
+}
+
+/// Parses the header of the Netpbm image at r->p and leaves r->p at its first pixel. Returns false
+/// if the header is malformed.
+bool parse_pnm_header(struct pnm_reader *r, int *w, int *h, int *channels, int *maxval)
+{
+	if (r->end - r->p < 3 || r->p[0] != 'P') {
+		return false;
+	}
+	char type = r->p[1];
+	r->p += 2;
+	if (type == '5' || type == '6') {
+		*channels = type == '5' ? 1 : 3;
+		*w = pnm_read_uint(r);
+		*h = pnm_read_uint(r);
+		*maxval = pnm_read_uint(r);
+		// Exactly one whitespace character separates the header from the raster.
+		if (r->p >= r->end || !pnm_is_space(*r->p++)) {
+			return false;
+		}
+	} else if (type == '7') {
+		*w = *h = *channels = *maxval = -1;
+		char word[32];
+		while (true) {
+			if (!pnm_read_word(r, word, sizeof(word))) {
+				return false;
+			}
+			if (strcmp(word, "ENDHDR") == 0) {
+				break;
+			} else if (strcmp(word, "WIDTH") == 0) {
+				*w = pnm_read_uint(r);
+			} else if (strcmp(word, "HEIGHT") == 0) {
+				*h = pnm_read_uint(r);
+			} else if (strcmp(word, "DEPTH") == 0) {
+				*channels = pnm_read_uint(r);
+			} else if (strcmp(word, "MAXVAL") == 0) {
+				*maxval = pnm_read_uint(r);
+			} else if (strcmp(word, "TUPLTYPE") == 0) {
+				// The depth alone determines the channel layout.
+				while (r->p < r->end && *r->p != '\n') {
+					++r->p;
+				}
+			} else {
+				return false;
+			}
+		}
+		if (r->p >= r->end || *r->p++ != '\n') {
+			return false;
+		}
+	} else {
+		return false;
+	}
+	return *w > 0 && *h > 0 && *channels >= 1 && *channels <= 4 && *maxval > 0;
+}
+
+/// Loads all consecutive raw Netpbm images in 'file'. The frames point directly into the file data.
+struct animation load_netpbm(struct file_data const *file, char const *name)
+{
+	struct animation animation = {0};
+	struct pnm_reader r = {.p = file->data, .end = file->data + file->size};
+	int capacity = 0;
+	while (r.p < r.end) {
+		int w, h, channels, maxval;
+		if (!parse_pnm_header(&r, &w, &h, &channels, &maxval)) {
+			fatal("cannot parse image '%s': corrupt Netpbm header", name);
+		}
+		if (maxval != 255) {
+			fatal("cannot parse image '%s': only 8-bit Netpbm images are supported", name);
+		}
+		size_t size = (size_t) w * h * channels;
+		if ((size_t) (r.end - r.p) < size) {
+			fatal("cannot parse image '%s': truncated Netpbm image", name);
+		}
+		if (animation.frame_count > 0) {
+			struct image const *first = &animation.frames[0];
+			if (w != first->w || h != first->h || channels != first->channels) {
+				fatal("cannot parse image '%s': all images must have the same size and layout", name);
+			}
+		}
+		if (animation.frame_count == capacity) {
+			capacity = capacity ? capacity * 2 : 1;
+			animation.frames = realloc(animation.frames, capacity * sizeof(struct image));
+			if (animation.frames == NULL) {
+				fatal("no memory");
+			}
+		}
+		animation.frames[animation.frame_count++] = (struct image) {
+				.pixels = (unsigned char *) r.p,
+				.w = w,
+				.h = h,
+				.channels = channels,
+		};
+		r.p += size;
+		pnm_skip_space(&r);
+	}
+	if (animation.frame_count == 0) {
+		fatal("cannot parse image '%s': empty Netpbm file", name);
+	}
+	return animation;
+}
+
+struct animation load_animation(struct file_data const *file, char const *name, int scale)
+{
+	if (file->size >= 2 && file->data[0] == 'P' && file->data[1] >= '5' && file->data[1] <= '7') {
+		return load_netpbm(file, name);
+	}
+	if (file->size > INT_MAX) {
+		fatal("image '%s' is too large", name);
+	}
+
+	int w = 0, h = 0, channels = 0;
+	struct animation animation = {.frame_count = 1};
+	if (file->size >= 4 && memcmp(file->data, "qoif", 4) == 0) {
+		animation.decoded = qoi_decode(file->data, file->size, &w, &h, &channels);
+		if (animation.decoded == NULL) {
+			fatal("cannot parse image '%s': corrupt QOI image", name);
+		}
+	} else if (file->size >= 4 && memcmp(file->data, "GIF8", 4) == 0) {
+		// GIF frames are always decoded as RGBA. The quantizer ignores alpha, so ask for RGB.
+		animation.decoded = stbi_load_gif_from_memory(file->data, (int) file->size, &animation.delays,
+				&w, &h, &animation.frame_count, &channels, 3);
+		channels = 3;
+		// Truncated files can decode to no frames at all.
+		if (animation.decoded == NULL || animation.frame_count < 1) {
+			fatal("cannot parse image '%s': %s", name, animation.decoded == NULL
+					? stbi_failure_reason() : "GIF image without frames");
+		}
+	} else {
+		// The scale only applies to this thread, so that other threads can load at the same time.
+		stbi_set_jpeg_scale_on_load_thread(scale);
+		animation.decoded = stbi_load_from_memory(file->data, (int) file->size, &w, &h, &channels, 0);
+		stbi_set_jpeg_scale_on_load_thread(1);
+	}
+	if (animation.decoded == NULL) {
+		fatal("cannot parse image '%s': %s", name, stbi_failure_reason());
+	}
+
+	animation.frames = xmalloc(animation.frame_count * sizeof(struct image));
+	for (int i = 0; i < animation.frame_count; ++i) {
+		animation.frames[i] = (struct image) {
+				.pixels = animation.decoded + (size_t) i * w * h * channels,
+				.w = w,
+				.h = h,
+				.channels = channels,
+		};
+	}
+	return animation;
+}
+
+bool animation_is_downscaled(struct animation const *animation, struct file_data const *file)
+{
+	int w = 0, h = 0;
+	return animation->decoded != NULL && file->size <= INT_MAX
+			&& stbi_info_from_memory(file->data, (int) file->size, &w, &h, NULL)
+			&& (w != animation->frames[0].w || h != animation->frames[0].h);
+}
+
+void free_animation(struct animation *animation)
+{
+	// All decoded frames share one allocation. stb_image and the QOI decoder both use malloc.
+	free(animation->decoded);
+	stbi_image_free(animation->delays);
+	free(animation->frames);
+	*animation = (struct animation) {0};
+}
+
+bool sync_outputs = false;
+
+/// An output file that waits for commit_outputs under its temporary name.
+struct pending_output {
+	char *path;
+	char *temp_path; // NULL once renamed.
+};
+
+struct pending_output *pending_outputs = NULL;
+size_t pending_count = 0;
+
+/// Removes the temporary files of all pending outputs, so that a failure leaves nothing behind.
+void remove_pending_outputs(void)
+{
+	for (size_t i = 0; i < pending_count; ++i) {
+		if (pending_outputs[i].temp_path != NULL) {
+			unlink(pending_outputs[i].temp_path);
+		}
+	}
+}
+
+FILE *open_output(char const *path)
+{
+	if (strcmp(path, "-") == 0) {
+		return stdout;
+	}
+	// The temporary file is a hidden file in the same directory, so that rename() can replace the
+	// output atomically.
+	char const *slash = strrchr(path, '/');
+	int const dir_len = slash != NULL ? (int) (slash - path + 1) : 0;
+	size_t const len = strlen(path) + 9;
+	char *temp_path = xmalloc(len);
+	snprintf(temp_path, len, "%.*s.%s.XXXXXX", dir_len, path, path + dir_len);
+	int fd = mkstemp(temp_path);
+	if (fd < 0) {
+		fatal("cannot write image '%s': %s", path, strerror(errno));
+	}
+	// mkstemp creates files that only the owner can read.
+	mode_t mask = umask(0);
+	umask(mask);
+	fchmod(fd, 0666 & ~mask);
+
+	if (pending_count == 0 && pending_outputs == NULL) {
+		atexit(remove_pending_outputs);
+	}
+	pending_outputs = realloc(pending_outputs, (pending_count + 1) * sizeof(pending_outputs[0]));
+	if (pending_outputs == NULL) {
+		fatal("no memory");
+	}
+	pending_outputs[pending_count++] = (struct pending_output) {strdup(path), temp_path};
+	FILE *file = fdopen(fd, "wb");
+	if (file == NULL) {
+		fatal("cannot write image '%s': %s", path, strerror(errno));
+	}
+	return file;
+}
+
+void close_output(FILE *file, char const *path)
+{
+	bool failed = ferror(file) != 0;
+	if (file == stdout) {
+		failed |= fflush(file) != 0;
+	} else {
+		failed |= fclose(file) != 0;
+	}
+	if (failed) {
+		fatal("cannot write image '%s'", path);
+	}
+}
+
+/// Flushes the file or directory at 'path' to the disk.
+void sync_path(char const *path, bool directory)
+{
+	int fd = open(path, directory ? O_RDONLY | O_DIRECTORY : O_RDONLY);
+	if (fd < 0 || (directory ? fsync(fd) : fdatasync(fd)) != 0) {
+		fatal("cannot sync '%s': %s", path, strerror(errno));
+	}
+	close(fd);
+}
+
+void commit_outputs(void)
+{
+	// Syncing all files at the end lets the kernel write them back while the next ones are encoded.
+	if (sync_outputs) {
+		for (size_t i = 0; i < pending_count; ++i) {
+			sync_path(pending_outputs[i].temp_path, false);
+		}
+	}
+	for (size_t i = 0; i < pending_count; ++i) {
+		struct pending_output *output = &pending_outputs[i];
+		if (rename(output->temp_path, output->path) != 0) {
+			fatal("cannot write image '%s': %s", output->path, strerror(errno));
+		}
+		free(output->temp_path);
+		output->temp_path = NULL;
+	}
+	// Make the renames durable, once for every directory.
+	char *last_dir = NULL;
+	for (size_t i = 0; i < pending_count && sync_outputs; ++i) {
+		char const *path = pending_outputs[i].path;
+		char const *slash = strrchr(path, '/');
+		char *dir = slash == NULL ? strdup(".") : slash == path ? strdup("/") : strndup(path, slash - path);
+		if (last_dir == NULL || strcmp(dir, last_dir) != 0) {
+			sync_path(dir, true);
+		}
+		free(last_dir);
+		last_dir = dir;
+	}
+	free(last_dir);
+	for (size_t i = 0; i < pending_count; ++i) {
+		free(pending_outputs[i].path);
+	}
+	pending_count = 0;
+}
+
+/// stbi_write_func that appends to the FILE in 'context'.
+void write_to_file(void *context, void *data, int size)
+{
+	fwrite(data, 1, size, context);
+}
+
+void write_png(FILE *file, struct image const *image, struct png_settings const *settings)
+{
+	struct png_image png = {image->w, image->h, image->channels, image->pixels, NULL, 0};
+	write_png_image(file, &png, settings);
+}
+
+void write_qoi(FILE *file, struct image const *image)
+{
+	size_t size = 0;
+	unsigned char *data = qoi_encode(image->pixels, image->w, image->h, image->channels, &size);
+	fwrite(data, 1, size, file);
+	free(data);
+}
+
+void write_netpbm(FILE *file, enum format format, struct image const *images, int image_count)
+{
+	static char const *const tuple_types[] = {"GRAYSCALE", "GRAYSCALE_ALPHA", "RGB", "RGB_ALPHA"};
+	for (int i = 0; i < image_count; ++i) {
+		struct image const *image = &images[i];
+		size_t const pixel_count = (size_t) image->w * image->h;
+		if (format == FORMAT_PAM) {
+			fprintf(file, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH %d\nMAXVAL 255\nTUPLTYPE %s\nENDHDR\n",
+					image->w, image->h, image->channels, tuple_types[image->channels - 1]);
+			fwrite(image->pixels, image->channels, pixel_count, file);
+			continue;
+		}
+
+		bool gray = image->channels < 3;
+		fprintf(file, "P%c\n%d %d\n255\n", gray ? '5' : '6', image->w, image->h);
+		if (image->channels == 1 || image->channels == 3) {
+			fwrite(image->pixels, image->channels, pixel_count, file);
+			continue;
+		}
+		// PGM and PPM cannot store alpha. It is always opaque after quantization anyway.
+		int const out_channels = image->channels - 1;
+		unsigned char *data = xmalloc(pixel_count * out_channels);
+		for (size_t p = 0; p < pixel_count; ++p) {
+			memcpy(data + p * out_channels, image->pixels + p * image->channels, out_channels);
+		}
+		fwrite(data, out_channels, pixel_count, file);
+		free(data);
+	}
+}
+
+void write_indexed_image(FILE *file, enum format format, unsigned char const *indices, int w, int h,
+		struct palette const *palette, struct png_settings const *settings)
+{
+	unsigned char const *colors = palette->colors[0].rgb;
+	if (format != FORMAT_TGA && format != FORMAT_BMP) {
+		struct png_image png = {w, h, 1, indices, colors, palette->colors_count};
+		write_png_image(file, &png, settings);
+		return;
+	}
+	int ok;
+	if (format == FORMAT_TGA) {
+		ok = stbi_write_tga_indexed_to_func(write_to_file, file, w, h, indices, colors, palette->colors_count);
+	} else {
+		ok = stbi_write_bmp_indexed_to_func(write_to_file, file, w, h, indices, colors, palette->colors_count);
+	}
+	if (!ok) {
+		fatal("cannot encode indexed image");
+	}
+}
+
+void write_palette_record(FILE *file, struct palette const *palette)
+{
+	fputc('P', file);
+	fputc(palette->colors_count - 1, file);
+	fwrite(palette->colors, sizeof(struct color), palette->colors_count, file);
+}
+
+void write_idx(FILE *file, unsigned char const *indices, int w, int h, int frame_count,
+		struct palette const *palette)
+{
+	write_palette_record(file, palette);
+	for (int i = 0; i < frame_count; ++i) {
+		fputc('F', file);
+		fwrite(indices + (size_t) i * w * h, 1, (size_t) w * h, file);
+	}
+}
+
+#define LZW_MAX_CODE 4096
+#define LZW_HASH_SIZE 8192
+
+/// Packs variable-length LZW codes into the data sub-blocks of a GIF image.
+struct lzw_writer {
+	FILE *file;
+	unsigned char block[256]; // Length byte followed by up to 255 data bytes.
+	uint32_t bits;
+	int bit_count;
+};
+
+void lzw_flush_block(struct lzw_writer *lzw)
+{
+	if (lzw->block[0] > 0) {
+		fwrite(lzw->block, 1, lzw->block[0] + 1, lzw->file);
+		lzw->block[0] = 0;
+	}
+}
+
+void lzw_put_code(struct lzw_writer *lzw, int code, int code_size)
+{
+	lzw->bits |= (uint32_t) code << lzw->bit_count;
+	lzw->bit_count += code_size;
+	while (lzw->bit_count >= 8) {
+		lzw->block[++lzw->block[0]] = lzw->bits & 0xff;
+		lzw->bits >>= 8;
+		lzw->bit_count -= 8;
+		if (lzw->block[0] == 255) {
+			lzw_flush_block(lzw);
+		}
+	}
+}
+
+/// Writes 'count' palette indices as LZW compressed GIF image data.
+void write_lzw(FILE *file, unsigned char const *indices, size_t count, int min_code_size)
+{
+	// The string table maps (prefix code, next index) pairs to codes. It is an open addressing hash
+	// table where a key of 0 marks an empty slot.
+	uint32_t keys[LZW_HASH_SIZE];
+	uint16_t codes[LZW_HASH_SIZE];
+	int const clear_code = 1 << min_code_size;
+	int next_code = clear_code + 2;
+	int code_size = min_code_size + 1;
+	struct lzw_writer lzw = {.file = file};
+
+	memset(keys, 0, sizeof(keys));
+	fputc(min_code_size, file);
+	lzw_put_code(&lzw, clear_code, code_size);
+	int prefix = indices[0];
+	for (size_t i = 1; i < count; ++i) {
+		uint32_t key = ((uint32_t) prefix << 8 | indices[i]) + 1;
+		uint32_t slot = (key * 2654435761u) >> 19;
+		while (keys[slot] != 0 && keys[slot] != key) {
+			slot = (slot + 1) & (LZW_HASH_SIZE - 1);
+		}
+		if (keys[slot] == key) {
+			prefix = codes[slot];
+			continue;
+		}
+
+		lzw_put_code(&lzw, prefix, code_size);
+		keys[slot] = key;
+		codes[slot] = next_code++;
+		if (next_code == LZW_MAX_CODE) {
+			// The table is full, start over with a fresh one.
+			lzw_put_code(&lzw, clear_code, code_size);
+			memset(keys, 0, sizeof(keys));
+			next_code = clear_code + 2;
+			code_size = min_code_size + 1;
+		} else if (next_code > 1 << code_size) {
+			// The decoder adds its entries one code later, so it only needs the larger code size
+			// once next_code has passed the power of two.
+			++code_size;
+		}
+		prefix = indices[i];
+	}
+	lzw_put_code(&lzw, prefix, code_size);
+	lzw_put_code(&lzw, clear_code + 1, code_size);
+	if (lzw.bit_count > 0) {
+		lzw_put_code(&lzw, 0, 8 - lzw.bit_count);
+	}
+	lzw_flush_block(&lzw);
+	fputc(0, file);
+}
+
+void write_gif(FILE *file, unsigned char const *indices, int w, int h, int frame_count,
+		int const *delays, struct palette const *palette)
+{
+	if (w > 0xffff || h > 0xffff) {
+		fatal("image is too large for GIF");
+	}
+
+	// The color table holds 2^(table_bits + 1) entries.
+	int table_bits = 0;
+	while (1 << (table_bits + 1) < palette->colors_count) {
+		++table_bits;
+	}
+	fputs("GIF89a", file);
+	fputc(w & 0xff, file);
+	fputc(w >> 8, file);
+	fputc(h & 0xff, file);
+	fputc(h >> 8, file);
+	fputc(0x80 | 7 << 4 | table_bits, file);
+	fputc(0, file); // Background color
+	fputc(0, file); // Pixel aspect ratio
+	for (int i = 0; i < 1 << (table_bits + 1); ++i) {
+		struct color c = i < palette->colors_count ? palette->colors[i] : (struct color) {{0, 0, 0}};
+		fwrite(c.rgb, 1, 3, file);
+	}
+	if (frame_count > 1) {
+		// NETSCAPE2.0 application extension, loop forever.
+		fwrite("\x21\xff\x0bNETSCAPE2.0\x03\x01\x00\x00\x00", 1, 19, file);
+	}
+
+	for (int i = 0; i < frame_count; ++i) {
+		int delay = delays ? (delays[i] + 5) / 10 : 0;
+		// Graphic control extension without transparency. The frames are fully composited, so
+		// every frame simply replaces the previous one.
+		unsigned char control[] = {0x21, 0xf9, 4, 1 << 2, delay & 0xff, delay >> 8, 0, 0};
+		fwrite(control, 1, sizeof(control), file);
+		unsigned char descriptor[] = {0x2c, 0, 0, 0, 0, w & 0xff, w >> 8, h & 0xff, h >> 8, 0};
+		fwrite(descriptor, 1, sizeof(descriptor), file);
+		write_lzw(file, indices + (size_t) i * w * h, (size_t) w * h, table_bits < 1 ? 2 : table_bits + 1);
+	}
+	fputc(0x3b, file);
+}
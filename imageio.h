@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2023 Andrey Proskurin (proskur1n)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef IMAGEIO_H
+#define IMAGEIO_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include "mediancut.h"
+
+enum format {
+	FORMAT_PNG,
+	FORMAT_GIF,
+	FORMAT_PNM, // Binary PGM (P5) for gray images, PPM (P6) otherwise.
+	FORMAT_PAM, // Netpbm PAM (P7) in the channel layout of the image.
+	FORMAT_IDX, // Palette and frame records, see write_idx.
+	FORMAT_QOI,
+	FORMAT_TGA, // 8-bit color-mapped and RLE-compressed.
+	FORMAT_BMP, // 8-bit with a color table.
+};
+
+enum png_strategy {
+	PNG_AUTO, // See struct png_settings.
+	PNG_SEARCH, // DEFLATE_SEARCH, hash chains with lazy matching.
+	PNG_RLE, // DEFLATE_RLE, only runs of one byte.
+	PNG_HUFFMAN, // DEFLATE_HUFFMAN, no matches at all.
+	PNG_OPTIMAL, // zlib_compress_optimal, slow but much smaller.
+};
+
+/// How one PNG file is compressed. PNG_AUTO without a time budget uses PNG_RLE for indexed images
+/// with at most 16 colors and PNG_SEARCH for everything else. With a budget, the strategies are
+/// tried on a sample of rows from the fastest to the slowest, and the one with the smallest
+/// estimated output among those whose estimated time fits into the budget is used.
+struct png_settings {
+	enum png_strategy strategy;
+	int level; // Search effort of PNG_SEARCH, see deflate_open.
+	int iterations; // Parsing passes of PNG_OPTIMAL.
+	int filter; // Filter type of every row, or -1 for png_filter_row to choose.
+	int budget_ms; // Time budget of PNG_AUTO for one image, or 0 for none.
+};
+
+/// The contents of an input file, either mapped or read into memory.
+struct file_data {
+	unsigned char *data;
+	size_t size;
+	bool mapped;
+};
+
+/// A still image or the frames of an animation. All frames share the same size and channel layout.
+struct animation {
+	struct image *frames;
+	int frame_count;
+	int *delays; // Delay of every frame in milliseconds, or NULL for still images.
+	unsigned char *decoded; // Decoded pixels of all frames, or NULL if they live in the file data.
+};
+
+/// Maps or reads the file at 'path' into memory. "-" is the standard input.
+struct file_data read_file(char const *path);
+
+void free_file(struct file_data *file);
+
+/// Returns the format for 'name', which is either a format name or a path with an extension.
+/// Returns 'fallback' if the name is not known.
+enum format format_from_name(char const *name, enum format fallback);
+
+/// Returns whether images in 'format' are written as palette indices.
+bool format_is_indexed(enum format format);
+
+/// Loads the image in 'file' in its native channel layout. Animated GIFs and multi-image Netpbm
+/// files are loaded with all of their frames. Raw Netpbm pixels are used in place and are not
+/// copied, so 'file' must outlive the animation. JPEG images are decoded at 1/scale of their size
+/// by scaling the DCT, which is much cheaper than a full decode. Other formats ignore 'scale', use
+/// animation_is_downscaled to tell the two cases apart.
+/// @param name Name of the file used in error messages.
+struct animation load_animation(struct file_data const *file, char const *name, int scale);
+
+/// Returns whether 'animation' was loaded from 'file' at less than its full size.
+bool animation_is_downscaled(struct animation const *animation, struct file_data const *file);
+
+void free_animation(struct animation *animation);
+
+/// Whether commit_outputs flushes the output files and their directories to the disk.
+extern bool sync_outputs;
+
+/// Opens 'path' for writing. The file is written under a temporary name in the same directory and
+/// only appears under 'path' once commit_outputs is called, so that readers never see a partial
+/// image. "-" is the standard output.
+FILE *open_output(char const *path);
+
+/// Closes a file returned by open_output and aborts the program if any write failed.
+void close_output(FILE *file, char const *path);
+
+/// Renames all closed output files to their final paths, after syncing them all at once if
+/// 'sync_outputs' is set.
+void commit_outputs(void);
+
+/// Writes 'image' as a PNG file in its own channel layout while it is encoded, see png_encode.
+void write_png(FILE *file, struct image const *image, struct png_settings const *settings);
+
+/// Writes 'image' as a QOI file. Gray images are expanded to RGB.
+void write_qoi(FILE *file, struct image const *image);
+
+/// Writes all images as consecutive Netpbm images, in 'format' FORMAT_PNM or FORMAT_PAM.
+void write_netpbm(FILE *file, enum format format, struct image const *images, int image_count);
+
+/// Writes a w * h plane of palette indices as an indexed PNG, TGA or BMP file. TGA and BMP are
+/// written without deflate, which makes them much faster to encode and decode than PNG.
+/// @param settings Compression of PNG files, unused for the other formats.
+void write_indexed_image(FILE *file, enum format format, unsigned char const *indices, int w, int h,
+		struct palette const *palette, struct png_settings const *settings);
+
+/// Writes 'frame_count' consecutive w * h planes of palette indices as a GIF file. The palette
+/// becomes the global color table and an animation loops forever.
+/// @param delays Delay of every frame in milliseconds, may be NULL for still images.
+void write_gif(FILE *file, unsigned char const *indices, int w, int h, int frame_count,
+		int const *delays, struct palette const *palette);
+
+/// Writes a palette record: the byte 'P', the number of colors minus one, then the colors as RGB.
+void write_palette_record(FILE *file, struct palette const *palette);
+
+/// Writes the raw indices-plus-palette format: a palette record followed by one frame record per
+/// frame, which is the byte 'F' followed by w * h palette indices.
+void write_idx(FILE *file, unsigned char const *indices, int w, int h, int frame_count,
+		struct palette const *palette);
+
+#endif
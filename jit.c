@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2023 Andrey Proskurin (proskur1n)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include "jit.h"
+#include "cpu.h"
+#include "util.h"
+
+#if defined(CPU_X86) && defined(__linux__)
+#include <sys/mman.h>
+#define JIT_X86
+#endif
+
+#define INTERNAL_SIZE 12 // cmp r32, imm32 and ja rel32
+#define LEAF_SIZE 6 // mov eax, imm32 and ret
+
+#ifdef JIT_X86
+/// Code generation state of compile_tree.
+struct emitter {
+	struct palette const *palette;
+	unsigned char *code;
+	size_t size;
+	size_t offsets[MAX_PALETTE * 2 - 1]; // Start of the code of every node.
+};
+
+void put_le32(unsigned char *p, uint32_t value)
+{
+	p[0] = value;
+	p[1] = value >> 8;
+	p[2] = value >> 16;
+	p[3] = value >> 24;
+}
+
+/// Emits the code of 'node' and its subtree in pre-order. The left child directly follows its
+/// parent, so that only the right child needs a jump.
+void emit_node(struct emitter *e, struct node const *node)
+{
+	// The arguments r, g and b are passed in edi, esi and edx.
+	static unsigned char const registers[3] = {7, 6, 2};
+	int const position = node - e->palette->nodes;
+	unsigned char *out = e->code + e->size;
+	e->offsets[position] = e->size;
+	if (node->leaf) {
+		out[0] = 0xb8; // mov eax, imm32
+		put_le32(out + 1, position);
+		out[5] = 0xc3; // ret
+		e->size += LEAF_SIZE;
+		return;
+	}
+	out[0] = 0x81; // cmp r32, imm32
+	out[1] = 0xf8 | registers[node->split.chan];
+	put_le32(out + 2, node->split.threshold);
+	out[6] = 0x0f; // ja rel32
+	out[7] = 0x87;
+	e->size += INTERNAL_SIZE;
+	emit_node(e, node->split.left);
+	put_le32(out + 8, e->code + e->size - (out + INTERNAL_SIZE));
+	emit_node(e, node->split.right);
+}
+#endif
+
+struct tree_code *compile_tree(struct palette const *palette)
+{
+#ifdef JIT_X86
+	// The baseline level keeps the portable walk of find_leaf testable on x86.
+	if (cpu_level() == CPU_BASELINE) {
+		return NULL;
+	}
+	struct emitter e = {.palette = palette};
+	size_t const capacity = (size_t) palette->nodes_count * INTERNAL_SIZE;
+	e.code = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (e.code == MAP_FAILED) {
+		return NULL;
+	}
+	emit_node(&e, &palette->nodes[0]);
+	// Never writable and executable at the same time.
+	if (mprotect(e.code, capacity, PROT_READ | PROT_EXEC) != 0) {
+		munmap(e.code, capacity);
+		return NULL;
+	}
+	struct tree_code *code = xmalloc(sizeof(*code));
+	code->code = e.code;
+	code->size = capacity;
+	for (int i = 0; i < palette->nodes_count; ++i) {
+		code->entry[i] = (tree_func *) (e.code + e.offsets[i]);
+	}
+	return code;
+#else
+	(void) palette;
+	return NULL;
+#endif
+}
+
+void free_tree_code(struct tree_code *code)
+{
+	if (code == NULL) {
+		return;
+	}
+#ifdef JIT_X86
+	munmap(code->code, code->size);
+#endif
+	free(code);
+}
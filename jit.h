@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2023 Andrey Proskurin (proskur1n)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef JIT_H
+#define JIT_H
+
+#include "mediancut.h"
+
+/// Compiled walk of a subtree with the System V calling convention. Returns the position in
+/// palette->nodes of the leaf that contains the color (r, g, b), like find_leaf.
+typedef unsigned tree_func(unsigned r, unsigned g, unsigned b);
+
+/// Machine code that walks the tree of a palette with the thresholds compiled in as immediates,
+/// instead of loading them from the nodes.
+struct tree_code {
+	unsigned char *code;
+	size_t size;
+	tree_func *entry[MAX_PALETTE * 2 - 1]; // Walk of the subtree below every node.
+};
+
+/// Compiles the tree of 'palette' into machine code. Returns NULL if this is not supported on the
+/// current platform, the system does not allow executable memory or MEDIANCUT_CPU is baseline, in
+/// which case the caller walks the tree itself.
+struct tree_code *compile_tree(struct palette const *palette);
+
+/// Frees code returned by compile_tree. 'code' may be NULL.
+void free_tree_code(struct tree_code *code);
+
+#endif
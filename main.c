@@ -15,261 +15,117 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <assert.h>
 #include <stdbool.h>
+#include <limits.h>
 #include <getopt.h>
 #include <errno.h>
-#include <stdarg.h>
+#include "mediancut.h"
+#include "imageio.h"
+#include "stream.h"
+#include "util.h"
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wunused-function"
-#pragma GCC diagnostic ignored "-Wunused-but-set-variable"
-#define STB_IMAGE_IMPLEMENTATION
-#define STBI_ONLY_PNG
-#define STBI_FAILURE_USERMSG
-#include "stb_image.h"
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb_image_write.h"
-#pragma GCC diagnostic pop
-
-#define MAX_PALETTE 128
-
-char const *argv0 = "mediancut";
-
-/// Prints a formatted error message to the stderr and aborts the program.
-void fatal(char const *format, ...)
-{
-	va_list va;
-	va_start(va, format);
-	fprintf(stderr, "%s: ", argv0);
-	vfprintf(stderr, format, va);
-	fputc('\n', stderr);
-	va_end(va);
-	exit(EXIT_FAILURE);
-}
-
-struct color {
-	unsigned char rgba[4];
-};
-
-struct node {
-	union {
-		// Internal nodes of the binary tree.
-		struct split {
-			struct node *left; // Contains values less-or-equals than the 'threshold'.
-			struct node *right; // Contains values larger than the 'threshold'.
-			unsigned char threshold;
-			unsigned char chan;
-		} split;
-
-		// Leaf nodes of the binary tree.
-		struct bucket {
-			struct color *data;
-			size_t data_count;
-			struct color avg_color;
-			unsigned char range; // Range of the longest dimension (range_chan)
-			unsigned char range_chan; // 0: red, 1: green, 2: blue
-		} bucket;
-	};
-	bool leaf;
-};
-
-unsigned int compare_chan;
-
-/// Compares two colors based on the color channel specified in the 'compare_chan' global variable.
-int compare_color(void const *a, void const *b)
-{
-	int arg1 = ((struct color *) a)->rgba[compare_chan];
-	int arg2 = ((struct color *) b)->rgba[compare_chan];
-	return arg1 - arg2;
-}
-
-/// Initializes a new leaf node with a bucket. This procedure does not initialize the average color
-/// 'avg_color' inside the new bucket.
-/// @param rgb Pointer to the RGB data.
-/// @param count Array length in 'rgb'.
-struct node make_bucket(struct color *rgb, size_t count)
+/// Parses an unsigned integer inside str and returns 0 on failure.
+int parse_uint(char const *str)
 {
-	if (count < 2) {
-		return (struct node) {.bucket = {.data=rgb, .data_count=count}, .leaf = true};
-	}
-
-	unsigned char max_range = 0;
-	unsigned char max_range_chan = 0;
-
-	for (int chan = 0; chan < 3; ++chan) {
-		unsigned char min = rgb[0].rgba[chan];
-		unsigned char max = min;
-		for (size_t i = 1; i < count; ++i) {
-			unsigned char v = rgb[i].rgba[chan];
-			if (v < min) {
-				min = v;
-			} else if (v > max) {
-				max = v;
-			}
-		}
-
-		if (max - min > max_range) {
-			max_range = max - min;
-			max_range_chan = chan;
-		}
+	errno = 0;
+	char *end = NULL;
+	long n = strtol(str, &end, 10);
+	if (str[0] == 0 || *end != 0 || errno != 0 || n < 0 || n >= INT_MAX) {
+		return 0;
 	}
-
-	struct bucket bucket = {
-			.data = rgb,
-			.data_count = count,
-			.range = max_range,
-			.range_chan = max_range_chan
-	};
-	return (struct node) {.bucket = bucket, .leaf = true};
+	return (int) n;
 }
 
-/// Returns the average of the 'count' elements inside 'pixels'. This procedure always returns 255
-/// for alpha.
-struct color compute_average_color(struct color *pixels, size_t count)
+/// Parses a frame size of the form WIDTHxHEIGHT and returns false on failure.
+bool parse_size(char const *str, int *w, int *h)
 {
-	struct color result = {{0, 0, 0, 255}};
-
-	for (int c = 0; c < 3; ++c) {
-		// This algorithm computes the mean of numbers without overflowing.
-		// It is taken from this Quora post: https://qr.ae/pG68Dk
-
-		unsigned char x = 0;
-		size_t y = 0;
-		for (size_t i = 0; i < count; ++i) {
-			x += pixels[i].rgba[c] / count;
-			unsigned char b = pixels[i].rgba[c] % count;
-			if (y >= count - b) {
-				++x;
-				y -= count - b;
-			} else {
-				y += b;
-			}
-		}
-		// Average is exactly x + y / N
-		// 0 <= y < N
-		result.rgba[c] = x;
+	char const *x = strchr(str, 'x');
+	if (x == NULL) {
+		return false;
 	}
-
-	return result;
-}
-
-/// Turns the given leaf node into an internal node with two buckets as children. This procedure may
-/// change the order of elements inside node->bucket.data to find its median. 'node' must have at
-/// least one element in it.
-void cut_bucket(struct node *out_left, struct node *out_right, struct node *node)
-{
-	assert(node->leaf);
-	assert(node->bucket.data_count > 0);
-	struct bucket *bucket = &node->bucket;
-
-	compare_chan = bucket->range_chan;
-	qsort(bucket->data, bucket->data_count, sizeof(struct color), compare_color);
-
-	struct split split = {
-			.left = out_left,
-			.right = out_right,
-			.threshold = bucket->data[bucket->data_count / 2].rgba[bucket->range_chan],
-			.chan = bucket->range_chan
-	};
-	size_t cut = 0;
-	while (cut < bucket->data_count && bucket->data[cut].rgba[split.chan] <= split.threshold) {
-		++cut;
+	char width[16];
+	if (x - str >= (long) sizeof(width)) {
+		return false;
 	}
-	// Note that this is a slightly modified version of the median cut algorithm, as it does not
-	// divide exactly at the median (bucket->data_count / 2), but at the first value that is
-	// greater than the median (threshold).
-
-	*out_left = make_bucket(bucket->data, cut);
-	*out_right = make_bucket(bucket->data + cut, bucket->data_count - cut);
-	*node = (struct node) {.split = split, .leaf = false};
+	memcpy(width, str, x - str);
+	width[x - str] = 0;
+	*w = parse_uint(width);
+	*h = parse_uint(x + 1);
+	return *w > 0 && *h > 0 && (size_t) *w * *h <= INT_MAX / 4;
 }
 
-/// Computes the quantized color using the provided palette specified by its root node. You must
-/// call set_average_color on every bucket inside the binary tree before calling this function.
-struct color lookup_color_from_palette(struct node const *root, struct color color)
+/// Returns 'path' with the zero-padded frame number inserted before its extension, for example
+/// "out-07.png". The returned string must be freed by the caller.
+char *frame_path(char const *path, int frame, int frame_count)
 {
-	while (true) {
-		if (root->leaf) {
-			return root->bucket.avg_color;
-		}
-		if (color.rgba[root->split.chan] <= root->split.threshold) {
-			root = root->split.left;
-		} else {
-			root = root->split.right;
-		}
+	char const *slash = strrchr(path, '/');
+	char const *dot = strrchr(path, '.');
+	if (dot == NULL || (slash != NULL && dot < slash)) {
+		dot = path + strlen(path);
 	}
+	int digits = snprintf(NULL, 0, "%d", frame_count - 1);
+	size_t len = strlen(path) + digits + 2;
+	char *result = xmalloc(len);
+	snprintf(result, len, "%.*s-%0*d%s", (int) (dot - path), path, digits, frame, dot);
+	return result;
 }
 
-/// Performs the median cut color quantization algorithm in-place on the given image pixels.
-/// @param palette_count Number of distinct colors in the output image. Must be <= MAX_PALETTE.
-/// @param image_data    Image pixels
-/// @param w Width of the image.
-/// @param h Height of the image.
-void median_cut(int palette_count, struct color *image_data, int w, int h)
+/// Parses the name of a palette order and returns false on failure.
+bool parse_order(char const *str, enum palette_order *order)
 {
-	assert(palette_count > 0 && palette_count <= MAX_PALETTE);
-	struct color *temp = malloc(w * h * sizeof(struct color));
-	if (temp == NULL) {
-		fatal("no memory");
-	}
-	memcpy(temp, image_data, w * h * sizeof(struct color));
-
-	struct node nodes[MAX_PALETTE * 2 - 1];
-	int nodes_count = 0;
-	nodes[nodes_count++] = make_bucket(temp, w * h);
-
-	for (int p = 1; p < palette_count; ++p) {
-		// Find the bucket with the largest range.
-		struct node *largest = NULL;
-		unsigned char max_range = 0;
-		for (int i = 0; i < nodes_count; ++i) {
-			if (nodes[i].leaf && nodes[i].bucket.range >= max_range) {
-				max_range = nodes[i].bucket.range;
-				largest = &nodes[i];
-			}
-		}
-		if (max_range == 0) {
-			// There are no more buckets that can be divided.
-			break;
-		}
-
-		// Cut the bucket with the largest range into two buckets.
-		cut_bucket(&nodes[nodes_count], &nodes[nodes_count + 1], largest);
-		nodes_count += 2;
-	}
-
-	for (int i = 0; i < nodes_count; ++i) {
-		if (nodes[i].leaf) {
-			nodes[i].bucket.avg_color = compute_average_color(nodes[i].bucket.data, nodes[i].bucket.data_count);
+	static char const *const names[] = {"none", "luminance"};
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+		if (strcmp(str, names[i]) == 0) {
+			*order = (enum palette_order) i;
+			return true;
 		}
 	}
-	for (size_t i = 0; i < (size_t) w * h; ++i) {
-		image_data[i] = lookup_color_from_palette(&nodes[0], image_data[i]);
-	}
-	free(temp);
-}
-
-/// Parses an unsigned integer inside str and returns 0 on failure.
-int parse_uint(char const *str)
-{
-	errno = 0;
-	char *end = NULL;
-	long n = strtol(str, &end, 10);
-	if (str[0] == 0 || *end != 0 || errno != 0 || n < 0 || n >= INT_MAX) {
-		return 0;
-	}
-	return (int) n;
+	return false;
 }
 
 /// Prints usage information to the provided stream and exits the program.
 void usage(FILE *stream)
 {
-	fprintf(stream, "Usage: %s [-p N] INPUT OUTPUT\n\n", argv0);
+	fprintf(stream, "Usage: %s [-p N] [-s] [-d N] [-j N] [-f FMT] [-o ORDER] [-z N] INPUT OUTPUT\n", argv0);
+	fprintf(stream, "       %s [-p N] [-s] [-j N] -S WxH [-t N] < FRAMES > INDICES\n\n", argv0);
 	fputs("Performs color quantization on the given image using a slightly modified\n", stream);
-	fputs("version of the median cut algorithm.\n\n", stream);
+	fputs("version of the median cut algorithm. All frames of an animated GIF share one\n", stream);
+	fputs("palette and are written as a GIF or as numbered indexed PNGs (OUTPUT-N.png).\n", stream);
+	fputs("INPUT and OUTPUT may be - for the standard input and output, except that frames\n", stream);
+	fputs("only go to the standard output as gif, idx, ppm or pam.\n\n", stream);
+	fputs("Formats are png, gif, ppm (PGM for gray images), pam, qoi, tga, bmp and idx.\n", stream);
+	fputs("TGA and BMP are written as 8-bit indexed images. Multiple Netpbm images in one\n", stream);
+	fputs("file are read as frames. The idx format is a palette record followed by one\n", stream);
+	fputs("frame record per frame, as in stream mode.\n\n", stream);
+	fputs("In stream mode, raw RGBA frames are read from stdin. For every frame, a palette\n", stream);
+	fputs("update ('P', number of colors - 1, RGB colors) is written to stdout if needed,\n", stream);
+	fputs("followed by the frame ('F', one palette index per pixel).\n\n", stream);
+	fputs("The vectorized code is chosen for the processor at startup. The MEDIANCUT_CPU\n", stream);
+	fputs("environment variable (baseline, sse4, avx2 or avx512) limits it, e.g. for tests.\n", stream);
+	fputs("With baseline, the palette tree is also walked without compiling it.\n\n", stream);
 	fprintf(stream, "  -p N    Number of colors in the output image (default 4)\n");
+	fprintf(stream, "  -s      Build the palette from a 1/64 subsample (the first Adam7 pass)\n");
+	fprintf(stream, "  -d N    Build the palette from a 1/N downscaled image (N = 2, 4 or 8)\n");
+	fprintf(stream, "  -j N    Number of threads (default: number of processors)\n");
+	fprintf(stream, "  -f FMT  Output format (default: from the OUTPUT extension, else png)\n");
+	fprintf(stream, "  -o ORD  Palette order of indexed images: none (default) or luminance\n");
+	fprintf(stream, "  -z N    Compress PNG files with N passes of optimal parsing (slow, smaller)\n");
+	fprintf(stream, "  --png-speed N\n");
+	fprintf(stream, "          PNG compression: 0 searches for matches, 1 only encodes runs and 2 only\n");
+	fprintf(stream, "          Huffman codes (default: 1 for indexed PNGs with up to 16 colors, else 0)\n");
+	fprintf(stream, "          -z takes precedence\n");
+	fprintf(stream, "  --png-filter N\n");
+	fprintf(stream, "          Use PNG filter N (0 to 4) for every row (default: chosen per row, none\n");
+	fprintf(stream, "          for indexed PNGs)\n");
+	fprintf(stream, "  --png-budget MS\n");
+	fprintf(stream, "          Choose the PNG compression that gives the smallest file in about MS\n");
+	fprintf(stream, "          milliseconds per image, judging from a sample of rows (not with -z or\n");
+	fprintf(stream, "          --png-speed)\n");
+	fprintf(stream, "  --sync  Flush the output files to the disk before they appear under their name\n");
+	fprintf(stream, "  -S WxH  Quantize a stream of raw RGBA frames of the given size\n");
+	fprintf(stream, "  -t N    Rebuild the stream palette when over N%% of pixels changed (default 10)\n");
 	exit(stream == stderr ? EXIT_FAILURE : EXIT_SUCCESS);
 }
 
@@ -279,15 +135,32 @@ int main(int argc, char *argv[])
 		argv0 = argv[0];
 	}
 	int palette_count = 4;
+	int sample_step = 1;
+	int downscale = 1;
+	int stream_w = 0, stream_h = 0;
+	int scene_threshold = 10;
 	char const *input = NULL;
 	char const *output = NULL;
+	char const *format_name = NULL;
+	enum palette_order order = ORDER_NODES;
+	struct png_settings png = {.strategy = PNG_AUTO, .level = 8, .iterations = 5, .filter = -1};
 
 	struct option long_options[] = {
 			{"help", no_argument, NULL, 'h'},
+			{"sample", no_argument, NULL, 's'},
+			{"downscale", required_argument, NULL, 'd'},
+			{"threads", required_argument, NULL, 'j'},
+			{"stream", required_argument, NULL, 'S'},
+			{"threshold", required_argument, NULL, 't'},
+			{"optimize", required_argument, NULL, 'z'},
+			{"png-speed", required_argument, NULL, 'P'},
+			{"png-filter", required_argument, NULL, 'F'},
+			{"png-budget", required_argument, NULL, 'B'},
+			{"sync", no_argument, NULL, 'Y'},
 			{0},
 	};
 	int opt;
-	while ((opt = getopt_long(argc, argv, "hp:", long_options, NULL)) != -1) {
+	while ((opt = getopt_long(argc, argv, "hp:sd:j:S:t:f:o:z:", long_options, NULL)) != -1) {
 		switch (opt) {
 		case 'p':
 			if ((palette_count = parse_uint(optarg)) < 1) {
@@ -297,6 +170,77 @@ int main(int argc, char *argv[])
 				fatal("palette size is too large, maximum is %d", MAX_PALETTE);
 			}
 			break;
+		case 's':
+			sample_step = 8;
+			break;
+		case 'd':
+			downscale = parse_uint(optarg);
+			if (downscale != 2 && downscale != 4 && downscale != 8) {
+				usage(stderr);
+			}
+			break;
+		case 'j':
+			if ((thread_count = parse_uint(optarg)) < 1) {
+				usage(stderr);
+			}
+			if (thread_count > MAX_THREADS) {
+				thread_count = MAX_THREADS;
+			}
+			break;
+		case 'S':
+			if (!parse_size(optarg, &stream_w, &stream_h)) {
+				usage(stderr);
+			}
+			break;
+		case 't':
+			scene_threshold = parse_uint(optarg);
+			if ((scene_threshold == 0 && strcmp(optarg, "0") != 0) || scene_threshold > 100) {
+				usage(stderr);
+			}
+			break;
+		case 'f':
+			format_name = optarg;
+			if (format_from_name(format_name, -1) == (enum format) -1) {
+				usage(stderr);
+			}
+			break;
+		case 'o':
+			if (!parse_order(optarg, &order)) {
+				usage(stderr);
+			}
+			break;
+		case 'z':
+			if ((png.iterations = parse_uint(optarg)) < 1) {
+				usage(stderr);
+			}
+			png.strategy = PNG_OPTIMAL;
+			break;
+		case 'P': {
+			static enum png_strategy const speeds[] = {PNG_SEARCH, PNG_RLE, PNG_HUFFMAN};
+			int speed = parse_uint(optarg);
+			if ((speed == 0 && strcmp(optarg, "0") != 0) || speed > 2) {
+				usage(stderr);
+			}
+			// -z takes precedence, in whichever order the options are given.
+			if (png.strategy != PNG_OPTIMAL) {
+				png.strategy = speeds[speed];
+			}
+			break;
+		}
+		case 'F':
+			png.filter = parse_uint(optarg);
+			if ((png.filter == 0 && strcmp(optarg, "0") != 0) || png.filter > 4) {
+				usage(stderr);
+			}
+			break;
+		case 'B':
+			if ((png.budget_ms = parse_uint(optarg)) < 1) {
+				usage(stderr);
+			}
+			break;
+		case 'Y':
+			sync_outputs = true;
+			break;
 		case 'h':
 			usage(stdout);
 			break;
@@ -305,24 +249,98 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (stream_w > 0) {
+		if (optind != argc) {
+			usage(stderr);
+		}
+		quantize_stream(stdin, stdout, stream_w, stream_h, palette_count, sample_step,
+				scene_threshold / 100.0);
+		return EXIT_SUCCESS;
+	}
 	if (optind + 2 != argc) {
 		usage(stderr);
 	}
 	input = argv[optind];
 	output = argv[optind + 1];
-
-	int w = 0, h = 0;
-	struct color *data = (struct color *) stbi_load(input, &w, &h, NULL, sizeof(struct color));
-	if (data == NULL) {
-		fatal("cannot parse image '%s': %s", input, stbi_failure_reason());
+	if (png.budget_ms > 0 && png.strategy != PNG_AUTO) {
+		// The budget chooses the strategy, so it cannot be combined with one.
+		usage(stderr);
+	}
+	enum format format = format_from_name(format_name ? format_name : output, FORMAT_PNG);
+
+	// Load the image in its native channel layout, so that opaque and gray images do not have to be
+	// expanded to RGBA.
+	struct palette palette = {0};
+	struct file_data file = read_file(input);
+	struct animation animation = load_animation(&file, input, downscale);
+	bool const single_file = format == FORMAT_GIF || format == FORMAT_IDX || format == FORMAT_PNM
+			|| format == FORMAT_PAM;
+	if (animation.frame_count > 1 && !single_file && strcmp(output, "-") == 0) {
+		// The other formats write every frame to a numbered file, see frame_path.
+		fatal("cannot write %d frames to the standard output, use gif, idx, ppm or pam",
+				animation.frame_count);
+	}
+	if (animation_is_downscaled(&animation, &file)) {
+		// Only JPEG images can be decoded at a lower resolution. Build the palette from the cheap
+		// decode and load the full image only for the remap.
+		median_cut(&palette, palette_count, animation.frames, animation.frame_count, sample_step);
+		free_animation(&animation);
+		animation = load_animation(&file, input, 1);
+	} else {
+		median_cut(&palette, palette_count, animation.frames, animation.frame_count,
+				sample_step * downscale);
 	}
 
-	median_cut(palette_count, data, w, h);
-
-	if (stbi_write_png(output, w, h, sizeof(struct color), data, 0) == 0) {
-		fatal("cannot write image '%s'", output);
+	int const w = animation.frames[0].w, h = animation.frames[0].h;
+	if (format_is_indexed(format) || (format == FORMAT_PNG && animation.frame_count > 1)) {
+		unsigned char *indices = xmalloc((size_t) w * h * animation.frame_count);
+		reorder_palette(&palette, order);
+		remap_indices(&palette, animation.frames, animation.frame_count, indices);
+		if (format == FORMAT_GIF || format == FORMAT_IDX) {
+			FILE *out = open_output(output);
+			if (format == FORMAT_GIF) {
+				write_gif(out, indices, w, h, animation.frame_count, animation.delays, &palette);
+			} else {
+				write_idx(out, indices, w, h, animation.frame_count, &palette);
+			}
+			close_output(out, output);
+		} else {
+			for (int i = 0; i < animation.frame_count; ++i) {
+				char *path = animation.frame_count > 1 ? frame_path(output, i, animation.frame_count)
+						: strdup(output);
+				FILE *out = open_output(path);
+				write_indexed_image(out, format, indices + (size_t) i * w * h, w, h, &palette, &png);
+				close_output(out, path);
+				free(path);
+			}
+		}
+		free(indices);
+	} else {
+		remap_image(&palette, animation.frames, animation.frame_count);
+		if (format == FORMAT_PNM || format == FORMAT_PAM) {
+			FILE *out = open_output(output);
+			write_netpbm(out, format, animation.frames, animation.frame_count);
+			close_output(out, output);
+		} else {
+			// PNG files only get here with a single frame, QOI frames are numbered like PNGs.
+			for (int i = 0; i < animation.frame_count; ++i) {
+				char *path = animation.frame_count > 1 ? frame_path(output, i, animation.frame_count)
+						: strdup(output);
+				FILE *out = open_output(path);
+				if (format == FORMAT_QOI) {
+					write_qoi(out, &animation.frames[i]);
+				} else {
+					write_png(out, &animation.frames[i], &png);
+				}
+				close_output(out, path);
+				free(path);
+			}
+		}
 	}
-	stbi_image_free(data);
+	commit_outputs();
+	free_palette(&palette);
+	free_animation(&animation);
+	free_file(&file);
 
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,1290 @@
+/*
+ * Copyright (c) 2023 Andrey Proskurin (proskur1n)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include "mediancut.h"
+#include "cpu.h"
+#include "jit.h"
+#include "util.h"
+
+// Number of bytes of one channel that the color kernels process at once.
+#define PLANE_LANES 64
+
+// Palettes with up to this many colors are remapped by testing every pixel against the boxes of
+// all leaves at once, which is faster than walking the tree.
+#define BOX_LANES 16
+
+// The tables that count the sampled colors give up once more than half of at least this many
+// samples were distinct, as the cuts would hardly get fewer colors to work on.
+#define COUNT_MIN_SAMPLES (1 << 16)
+#define COUNT_BATCH 256 // Number of samples of a row that are loaded before they are counted.
+#define COUNT_PREFETCH 16 // Distance in samples at which the slots of the colors are prefetched.
+#define MERGE_RANGE_BITS 8 // The counts of all threads are merged in this many ranges of hashes.
+#define MERGE_RANGES (1 << MERGE_RANGE_BITS)
+
+#define CACHE_SHIFT 2 // Cells of palette->cache hold the colors that only differ in these low bits.
+#define CACHE_SIZE (1 << 3 * (8 - CACHE_SHIFT))
+#define CACHE_COLORS_BITS 14 // The second level of the cache fits into 64 KiB.
+
+#ifdef CPU_X86
+#include <immintrin.h>
+#endif
+
+/// Reads the color of the pixel at 'p'. Gray pixels are expanded to r = g = b and alpha is ignored.
+struct color load_color(unsigned char const *p, int channels)
+{
+	if (channels < 3) {
+		return (struct color) {{p[0], p[0], p[0]}};
+	}
+	return (struct color) {{p[0], p[1], p[2]}};
+}
+
+/// Writes 'color' to the pixel at 'p' and makes it fully opaque. Gray layouts only store the red
+/// channel, which is correct as long as the palette was built from gray pixels only.
+void store_color(unsigned char *p, int channels, struct color color)
+{
+	switch (channels) {
+	case 1:
+		p[0] = color.rgb[0];
+		break;
+	case 2:
+		p[0] = color.rgb[0];
+		p[1] = 255;
+		break;
+	case 4:
+		p[3] = 255;
+		// fallthrough
+	case 3:
+		memcpy(p, color.rgb, 3);
+		break;
+	default:
+		assert(false);
+	}
+}
+
+/// Colors stored as one array per channel. Scans of a single channel read a contiguous stream of
+/// bytes, and the kernels work on whole SIMD registers of one channel.
+struct planes {
+	unsigned char *chan[3];
+	uint32_t *weights; // Number of samples of each color, NULL if every color is a single sample.
+};
+
+/// Returns the colors of 'planes' from position 'offset' on.
+struct planes planes_at(struct planes planes, size_t offset)
+{
+	return (struct planes) {
+			{planes.chan[0] + offset, planes.chan[1] + offset, planes.chan[2] + offset},
+			planes.weights == NULL ? NULL : planes.weights + offset
+	};
+}
+
+/// Stores the smallest and the largest of the 'count' values at 'p' in 'min' and 'max'. The
+/// kernels take a single channel, as GCC only vectorizes the loop if 'p' is a parameter.
+CPU_KERNEL void plane_bounds_kernel(unsigned char const *p, size_t count, unsigned char *min,
+		unsigned char *max)
+{
+	unsigned char lo[PLANE_LANES], hi[PLANE_LANES];
+	memset(lo, 255, sizeof(lo));
+	memset(hi, 0, sizeof(hi));
+	size_t i = 0;
+	for (; i + PLANE_LANES <= count; i += PLANE_LANES) {
+		for (int j = 0; j < PLANE_LANES; ++j) {
+			lo[j] = p[i + j] < lo[j] ? p[i + j] : lo[j];
+			hi[j] = p[i + j] > hi[j] ? p[i + j] : hi[j];
+		}
+	}
+	// Stores through 'min' and 'max' could alias 'p', so reduce into locals first.
+	unsigned char low = 255, high = 0;
+	for (int j = 0; j < PLANE_LANES; ++j) {
+		low = lo[j] < low ? lo[j] : low;
+		high = hi[j] > high ? hi[j] : high;
+	}
+	for (; i < count; ++i) {
+		low = p[i] < low ? p[i] : low;
+		high = p[i] > high ? p[i] : high;
+	}
+	*min = low;
+	*max = high;
+}
+
+void plane_bounds_baseline(unsigned char const *p, size_t count, unsigned char *min,
+		unsigned char *max)
+{
+	plane_bounds_kernel(p, count, min, max);
+}
+
+#ifdef CPU_X86
+CPU_TARGET_AVX2 void plane_bounds_avx2(unsigned char const *p, size_t count, unsigned char *min,
+		unsigned char *max)
+{
+	plane_bounds_kernel(p, count, min, max);
+}
+
+CPU_TARGET_AVX512 void plane_bounds_avx512(unsigned char const *p, size_t count,
+		unsigned char *min, unsigned char *max)
+{
+	plane_bounds_kernel(p, count, min, max);
+}
+#endif
+
+/// Returns the sum of the 'count' values at 'p'.
+CPU_KERNEL uint64_t plane_sum_kernel(unsigned char const *p, size_t count)
+{
+	// The 32-bit lanes cannot overflow within (2^32 - 1) / 255 blocks.
+	size_t const max_blocks = UINT32_MAX / 255;
+	uint64_t sum = 0;
+	size_t i = 0;
+	while (i + PLANE_LANES <= count) {
+		uint32_t lanes[PLANE_LANES] = {0};
+		for (size_t b = 0; b < max_blocks && i + PLANE_LANES <= count; ++b, i += PLANE_LANES) {
+			for (int j = 0; j < PLANE_LANES; ++j) {
+				lanes[j] += p[i + j];
+			}
+		}
+		for (int j = 0; j < PLANE_LANES; ++j) {
+			sum += lanes[j];
+		}
+	}
+	for (; i < count; ++i) {
+		sum += p[i];
+	}
+	return sum;
+}
+
+uint64_t plane_sum_baseline(unsigned char const *p, size_t count)
+{
+	return plane_sum_kernel(p, count);
+}
+
+#ifdef CPU_X86
+CPU_TARGET_AVX2 uint64_t plane_sum_avx2(unsigned char const *p, size_t count)
+{
+	return plane_sum_kernel(p, count);
+}
+
+CPU_TARGET_AVX512 uint64_t plane_sum_avx512(unsigned char const *p, size_t count)
+{
+	return plane_sum_kernel(p, count);
+}
+#endif
+
+/// Returns the channel with the largest range between 'min' and 'max' and stores that range in
+/// 'range'. Ties go to the first channel.
+unsigned char widest_chan(unsigned char const *min, unsigned char const *max, unsigned char *range)
+{
+	unsigned char max_range = 0;
+	unsigned char max_range_chan = 0;
+	for (int chan = 0; chan < 3; ++chan) {
+		if (max[chan] - min[chan] > max_range) {
+			max_range = max[chan] - min[chan];
+			max_range_chan = chan;
+		}
+	}
+	*range = max_range;
+	return max_range_chan;
+}
+
+/// Initializes a new leaf node with a bucket of the 'count' colors at 'colors', which stand for
+/// 'samples' sampled pixels. This procedure does not initialize the average color 'avg_color'
+/// inside the new bucket.
+struct node make_bucket(struct planes const *colors, size_t count, size_t samples)
+{
+	if (count < 2) {
+		return (struct node) {.bucket = {.data_count=samples}, .leaf = true};
+	}
+
+	unsigned char min[3], max[3];
+	for (int c = 0; c < 3; ++c) {
+		CPU_DISPATCH(plane_bounds, colors->chan[c], count, &min[c], &max[c]);
+	}
+	unsigned char max_range;
+	unsigned char max_range_chan = widest_chan(min, max, &max_range);
+
+	struct bucket bucket = {
+			.data_count = samples,
+			.range = max_range,
+			.range_chan = max_range_chan
+	};
+	return (struct node) {.bucket = bucket, .leaf = true};
+}
+
+/// Returns the average of the 'samples' pixels that the 'count' colors at 'colors' stand for,
+/// rounded down.
+struct color compute_average_color(struct planes const *colors, size_t count, size_t samples)
+{
+	struct color result = {{0, 0, 0}};
+	if (samples == 0) {
+		return result;
+	}
+	// The 64-bit sums cannot overflow for any number of pixels that fits into memory.
+	for (int c = 0; c < 3; ++c) {
+		uint64_t sum = 0;
+		if (colors->weights == NULL) {
+			sum = CPU_DISPATCH(plane_sum, colors->chan[c], count);
+		} else {
+			for (size_t i = 0; i < count; ++i) {
+				sum += (uint64_t) colors->chan[c][i] * colors->weights[i];
+			}
+		}
+		result.rgb[c] = sum / samples;
+	}
+	return result;
+}
+
+/// The state of a leaf of median_cut that is not part of struct bucket.
+struct build_bucket {
+	struct planes data; // The colors of the bucket.
+	struct planes spare; // Room for as many colors as the bucket, where cuts move them to.
+	size_t count; // Number of colors in 'data', fewer than the samples if they have weights.
+};
+
+/// Returns the value at position count / 2 of the sorted 'count' values counted in 'hist', and
+/// stores the number of values less-or-equals than it in 'left'.
+unsigned char histogram_median(size_t const *hist, size_t count, size_t *left)
+{
+	size_t below = 0;
+	int median = 0;
+	while (below + hist[median] <= count / 2) {
+		below += hist[median++];
+	}
+	*left = below + hist[median];
+	return median;
+}
+
+/// Copies the 'count' colors at 'data' with a value in channel 'chan' less-or-equals than
+/// 'threshold' to 'out' from position 'left' on and the others from position 'right' on, both in
+/// their original order.
+CPU_KERNEL void partition_colors_kernel(struct planes data, size_t count, int chan,
+		unsigned char threshold, struct planes out, size_t left, size_t right)
+{
+	// Branchless, as the side of a color is unpredictable. The channels are spelled out, so that
+	// the pointers stay in registers.
+	unsigned char const *values = data.chan[chan];
+	unsigned char const *r = data.chan[0], *g = data.chan[1], *b = data.chan[2];
+	unsigned char *out_r = out.chan[0], *out_g = out.chan[1], *out_b = out.chan[2];
+	for (size_t i = 0; i < count; ++i) {
+		bool const greater = values[i] > threshold;
+		size_t const pos = greater ? right : left;
+		out_r[pos] = r[i];
+		out_g[pos] = g[i];
+		out_b[pos] = b[i];
+		left += !greater;
+		right += greater;
+	}
+}
+
+/// Copies the 'count' colors at 'data' with a value in channel 'chan' less-or-equals than
+/// 'threshold' to the first 'cut' colors at 'out' and the others behind them, both in their
+/// original order. 'cut' must be the number of colors on the left.
+void partition_colors_baseline(struct planes const *data, size_t count, int chan,
+		unsigned char threshold, struct planes const *out, size_t cut)
+{
+	partition_colors_kernel(*data, count, chan, threshold, *out, 0, cut);
+}
+
+#ifdef CPU_X86
+// partition_shuffles[m] holds the positions of the set bits of m in its low 8 bytes and those of
+// the clear bits in its high 8 bytes, both in ascending order. It is a shuffle control for the AVX2
+// partitions, which would otherwise need pext, and pext is microcoded on AMD CPUs before Zen 3.
+unsigned char partition_shuffles[256][16] __attribute__((aligned(16)));
+pthread_once_t partition_shuffles_once = PTHREAD_ONCE_INIT;
+
+void init_partition_shuffles(void)
+{
+	for (int m = 0; m < 256; ++m) {
+		int left = 0, right = 8;
+		for (int j = 0; j < 8; ++j) {
+			partition_shuffles[m][m >> j & 1 ? left++ : right++] = j;
+		}
+	}
+}
+
+/// Returns the shuffle control of partition_shuffles for the 8-bit mask 'less_equal'.
+CPU_KERNEL CPU_TARGET_AVX2 __m128i partition_shuffle(unsigned less_equal)
+{
+	return _mm_load_si128((__m128i const *) partition_shuffles[less_equal]);
+}
+
+/// Copies the 'n' values of the 8 at 'in' that the shuffle control 'shuffle' of partition_shuffles
+/// puts first to 'left' and the others to 'right', which have room for 'left_room' and
+/// 'right_room' values. Where there is room, all 8 bytes of each side are written, as that is
+/// faster than writing exactly 'n'.
+CPU_KERNEL CPU_TARGET_AVX2 void partition_plane_8(unsigned char const *in, __m128i shuffle, int n,
+		unsigned char *left, size_t left_room, unsigned char *right, size_t right_room)
+{
+	__m128i const sides = _mm_shuffle_epi8(_mm_loadl_epi64((__m128i const *) in), shuffle);
+	if (left_room >= 8 && right_room >= 8) {
+		_mm_storel_epi64((__m128i *) left, sides);
+		_mm_storel_epi64((__m128i *) right, _mm_unpackhi_epi64(sides, sides));
+	} else {
+		unsigned char lanes[16];
+		_mm_storeu_si128((__m128i *) lanes, sides);
+		memcpy(left, lanes, n);
+		memcpy(right, lanes + 8, 8 - n);
+	}
+}
+
+/// Partitions 8 colors per step. The bytes of each side are gathered from 8 bytes of every channel
+/// at once by a shuffle, whose control is looked up with the comparison mask of the cut channel.
+CPU_TARGET_AVX2 void partition_colors_avx2(struct planes const *data, size_t count, int chan,
+		unsigned char threshold, struct planes const *out, size_t cut)
+{
+	pthread_once(&partition_shuffles_once, init_partition_shuffles);
+	unsigned char const *values = data->chan[chan];
+	unsigned char const *r = data->chan[0], *g = data->chan[1], *b = data->chan[2];
+	unsigned char *out_r = out->chan[0], *out_g = out->chan[1], *out_b = out->chan[2];
+	__m128i const limit = _mm_set1_epi8(threshold);
+	size_t left = 0, right = cut, i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m128i const v = _mm_loadl_epi64((__m128i const *) (values + i));
+		unsigned const less_equal = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(v, limit), v))
+				& 0xff;
+		__m128i const shuffle = partition_shuffle(less_equal);
+		int const n = __builtin_popcount(less_equal);
+		size_t const left_room = cut - left, right_room = count - right;
+		partition_plane_8(r + i, shuffle, n, out_r + left, left_room, out_r + right, right_room);
+		partition_plane_8(g + i, shuffle, n, out_g + left, left_room, out_g + right, right_room);
+		partition_plane_8(b + i, shuffle, n, out_b + left, left_room, out_b + right, right_room);
+		left += n;
+		right += 8 - n;
+	}
+	partition_colors_kernel(planes_at(*data, i), count - i, chan, threshold, *out, left, right);
+}
+
+/// Copies the 16 values at 'in' selected by 'less_equal' to 'left' and the others to 'right'. The
+/// values are widened to 32-bit lanes for the compress instruction and narrowed again by masked
+/// stores that write exactly the bytes of each side.
+CPU_KERNEL CPU_TARGET_AVX512 void partition_plane_16(unsigned char const *in,
+		__mmask16 less_equal, int n, unsigned char *left, unsigned char *right)
+{
+	__m512i const v = _mm512_cvtepu8_epi32(_mm_loadu_si128((__m128i const *) in));
+	_mm_mask_storeu_epi8(left, (1u << n) - 1,
+			_mm512_cvtepi32_epi8(_mm512_maskz_compress_epi32(less_equal, v)));
+	_mm_mask_storeu_epi8(right, (1u << (16 - n)) - 1,
+			_mm512_cvtepi32_epi8(_mm512_maskz_compress_epi32(~less_equal, v)));
+}
+
+/// Partitions 16 colors per step with the compress instruction of AVX-512.
+CPU_TARGET_AVX512 void partition_colors_avx512(struct planes const *data, size_t count, int chan,
+		unsigned char threshold, struct planes const *out, size_t cut)
+{
+	unsigned char const *values = data->chan[chan];
+	unsigned char const *r = data->chan[0], *g = data->chan[1], *b = data->chan[2];
+	unsigned char *out_r = out->chan[0], *out_g = out->chan[1], *out_b = out->chan[2];
+	__m128i const limit = _mm_set1_epi8(threshold);
+	size_t left = 0, right = cut, i = 0;
+	for (; i + 16 <= count; i += 16) {
+		__mmask16 const less_equal = _mm_cmple_epu8_mask(
+				_mm_loadu_si128((__m128i const *) (values + i)), limit);
+		int const n = __builtin_popcount(less_equal);
+		partition_plane_16(r + i, less_equal, n, out_r + left, out_r + right);
+		partition_plane_16(g + i, less_equal, n, out_g + left, out_g + right);
+		partition_plane_16(b + i, less_equal, n, out_b + left, out_b + right);
+		left += n;
+		right += 16 - n;
+	}
+	partition_colors_kernel(planes_at(*data, i), count - i, chan, threshold, *out, left, right);
+}
+#endif
+
+/// Copies the 'count' weights at 'weights' to 'out' in the same order as partition_colors copies
+/// their colors, whose values in the cut channel are at 'values'.
+CPU_KERNEL void partition_weights_kernel(uint32_t const *weights, unsigned char const *values,
+		size_t count, unsigned char threshold, uint32_t *out, size_t left, size_t right)
+{
+	for (size_t i = 0; i < count; ++i) {
+		bool const greater = values[i] > threshold;
+		out[greater ? right : left] = weights[i];
+		left += !greater;
+		right += greater;
+	}
+}
+
+void partition_weights_baseline(uint32_t const *weights, unsigned char const *values,
+		size_t count, unsigned char threshold, uint32_t *out, size_t cut)
+{
+	partition_weights_kernel(weights, values, count, threshold, out, 0, cut);
+}
+
+#ifdef CPU_X86
+/// Partitions 8 weights per step. The positions of each side come from partition_shuffles and
+/// gather the weights with a single permute.
+CPU_TARGET_AVX2 void partition_weights_avx2(uint32_t const *weights, unsigned char const *values,
+		size_t count, unsigned char threshold, uint32_t *out, size_t cut)
+{
+	pthread_once(&partition_shuffles_once, init_partition_shuffles);
+	__m128i const limit = _mm_set1_epi8(threshold);
+	size_t left = 0, right = cut, i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m128i const v = _mm_loadl_epi64((__m128i const *) (values + i));
+		unsigned const less_equal = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(v, limit), v))
+				& 0xff;
+		__m128i const shuffle = partition_shuffle(less_equal);
+		int const n = __builtin_popcount(less_equal);
+		__m256i const w = _mm256_loadu_si256((__m256i const *) (weights + i));
+		__m256i const l = _mm256_permutevar8x32_epi32(w, _mm256_cvtepu8_epi32(shuffle));
+		__m256i const r = _mm256_permutevar8x32_epi32(w, _mm256_cvtepu8_epi32(
+				_mm_unpackhi_epi64(shuffle, shuffle)));
+		if (cut - left >= 8 && count - right >= 8) {
+			_mm256_storeu_si256((__m256i *) (out + left), l);
+			_mm256_storeu_si256((__m256i *) (out + right), r);
+		} else {
+			uint32_t l_lanes[8], r_lanes[8];
+			_mm256_storeu_si256((__m256i *) l_lanes, l);
+			_mm256_storeu_si256((__m256i *) r_lanes, r);
+			memcpy(out + left, l_lanes, n * sizeof(uint32_t));
+			memcpy(out + right, r_lanes, (8 - n) * sizeof(uint32_t));
+		}
+		left += n;
+		right += 8 - n;
+	}
+	partition_weights_kernel(weights + i, values + i, count - i, threshold, out, left, right);
+}
+
+/// Partitions 16 weights per step with the compress instruction of AVX-512.
+CPU_TARGET_AVX512 void partition_weights_avx512(uint32_t const *weights,
+		unsigned char const *values, size_t count, unsigned char threshold, uint32_t *out,
+		size_t cut)
+{
+	__m128i const limit = _mm_set1_epi8(threshold);
+	size_t left = 0, right = cut, i = 0;
+	for (; i + 16 <= count; i += 16) {
+		__mmask16 const less_equal = _mm_cmple_epu8_mask(
+				_mm_loadu_si128((__m128i const *) (values + i)), limit);
+		int const n = __builtin_popcount(less_equal);
+		__m512i const w = _mm512_loadu_si512(weights + i);
+		_mm512_mask_storeu_epi32(out + left, (1u << n) - 1,
+				_mm512_maskz_compress_epi32(less_equal, w));
+		_mm512_mask_storeu_epi32(out + right, (1u << (16 - n)) - 1,
+				_mm512_maskz_compress_epi32(~less_equal, w));
+		left += n;
+		right += 16 - n;
+	}
+	partition_weights_kernel(weights + i, values + i, count - i, threshold, out, left, right);
+}
+#endif
+
+/// Turns the given leaf node into an internal node with two buckets as children. The colors and
+/// their weights are moved to build->spare, ordered by the child they belong to, and the children
+/// take over their parts of both buffers. 'node' must have at least one element in it.
+void cut_bucket(struct node *out_left, struct node *out_right, struct node *node,
+		struct build_bucket const *build, struct build_bucket *out_left_build,
+		struct build_bucket *out_right_build)
+{
+	assert(node->leaf);
+	assert(node->bucket.data_count > 0);
+	struct bucket *bucket = &node->bucket;
+
+	// Runs of equal values are common, so four histograms take turns to avoid waiting for the
+	// previous increment of the same counter.
+	size_t parts[4][256] = {{0}};
+	unsigned char const *values = build->data.chan[bucket->range_chan];
+	uint32_t const *weights = build->data.weights;
+	size_t i = 0;
+	if (weights == NULL) {
+		for (; i + 4 <= build->count; i += 4) {
+			++parts[0][values[i]];
+			++parts[1][values[i + 1]];
+			++parts[2][values[i + 2]];
+			++parts[3][values[i + 3]];
+		}
+	} else {
+		for (; i + 4 <= build->count; i += 4) {
+			parts[0][values[i]] += weights[i];
+			parts[1][values[i + 1]] += weights[i + 1];
+			parts[2][values[i + 2]] += weights[i + 2];
+			parts[3][values[i + 3]] += weights[i + 3];
+		}
+	}
+	for (; i < build->count; ++i) {
+		parts[0][values[i]] += weights == NULL ? 1 : weights[i];
+	}
+	size_t hist[256];
+	for (int v = 0; v < 256; ++v) {
+		hist[v] = parts[0][v] + parts[1][v] + parts[2][v] + parts[3][v];
+	}
+	size_t left_samples;
+	struct split split = {
+			.left = out_left,
+			.right = out_right,
+			.threshold = histogram_median(hist, bucket->data_count, &left_samples),
+			.chan = bucket->range_chan
+	};
+	// Note that this is a slightly modified version of the median cut algorithm, as it does not
+	// divide exactly at the median (bucket->data_count / 2), but at the first value that is
+	// greater than the median (threshold).
+	size_t cut = left_samples;
+	if (weights != NULL) {
+		cut = 0;
+		for (i = 0; i < build->count; ++i) {
+			cut += values[i] <= split.threshold;
+		}
+		CPU_DISPATCH(partition_weights, weights, values, build->count, split.threshold,
+				build->spare.weights, cut);
+	}
+	CPU_DISPATCH(partition_colors, &build->data, build->count, split.chan, split.threshold,
+			&build->spare, cut);
+
+	*out_left_build = (struct build_bucket) {
+			.data = build->spare,
+			.spare = build->data,
+			.count = cut
+	};
+	*out_right_build = (struct build_bucket) {
+			.data = planes_at(build->spare, cut),
+			.spare = planes_at(build->data, cut),
+			.count = build->count - cut
+	};
+	*out_left = make_bucket(&out_left_build->data, cut, left_samples);
+	*out_right = make_bucket(&out_right_build->data, build->count - cut,
+			bucket->data_count - left_samples);
+	*node = (struct node) {.split = split, .leaf = false};
+}
+
+/// Returns the leaf of the binary tree below 'root' whose bucket contains 'color'.
+struct node const *find_leaf(struct node const *root, struct color color)
+{
+	while (true) {
+		if (root->leaf) {
+			return root;
+		}
+		if (color.rgb[root->split.chan] <= root->split.threshold) {
+			root = root->split.left;
+		} else {
+			root = root->split.right;
+		}
+	}
+}
+
+struct color lookup_color_from_palette(struct node const *root, struct color color)
+{
+	return find_leaf(root, color)->bucket.avg_color;
+}
+
+unsigned char lookup_index_from_palette(struct node const *root, struct color color)
+{
+	return find_leaf(root, color)->bucket.index;
+}
+
+/// The boxes of the RGB cube that belong to the leaves of a small palette, one SIMD lane per leaf.
+/// Lane i contains the colors c with min[k][i] <= c.rgb[k] <= max[k][i] for every channel k.
+struct leaf_boxes {
+	unsigned char min[3][BOX_LANES];
+	unsigned char max[3][BOX_LANES];
+	unsigned char index[BOX_LANES]; // Palette index of the leaf in every lane.
+	unsigned lanes; // Bit mask of the lanes in use.
+};
+
+/// Adds the boxes of the leaves below 'node' to 'boxes', given the box of 'node' itself. The boxes
+/// of the leaves partition the RGB cube, except for the empty ones that no color can reach, which
+/// are left out.
+void collect_leaf_boxes(struct leaf_boxes *boxes, int *lane_count, struct node const *node,
+		int const *min, int const *max)
+{
+	for (int c = 0; c < 3; ++c) {
+		if (min[c] > max[c]) {
+			return;
+		}
+	}
+	if (node->leaf) {
+		int const lane = (*lane_count)++;
+		for (int c = 0; c < 3; ++c) {
+			boxes->min[c][lane] = min[c];
+			boxes->max[c][lane] = max[c];
+		}
+		boxes->index[lane] = node->bucket.index;
+		boxes->lanes |= 1u << lane;
+		return;
+	}
+	int left_max[3] = {max[0], max[1], max[2]};
+	int right_min[3] = {min[0], min[1], min[2]};
+	left_max[node->split.chan] = node->split.threshold;
+	right_min[node->split.chan] = node->split.threshold + 1;
+	collect_leaf_boxes(boxes, lane_count, node->split.left, min, left_max);
+	collect_leaf_boxes(boxes, lane_count, node->split.right, right_min, max);
+}
+
+/// Fills 'boxes' from the tree of 'palette' and returns whether it has few enough colors.
+bool make_leaf_boxes(struct leaf_boxes *boxes, struct palette const *palette)
+{
+	if (palette->colors_count > BOX_LANES) {
+		return false;
+	}
+	memset(boxes, 0, sizeof(*boxes));
+	int const min[3] = {0, 0, 0}, max[3] = {255, 255, 255};
+	int lane_count = 0;
+	collect_leaf_boxes(boxes, &lane_count, &palette->nodes[0], min, max);
+	return true;
+}
+
+#ifdef CPU_X86
+/// Stores the palette indices of the 'w' pixels at 'p' in 'out', by looking up the unique box of
+/// 'boxes' that contains each pixel. A value v lies within [min, max] exactly if clamping it to
+/// that range does not change it, which takes an unsigned min, max and compare per channel.
+CPU_KERNEL void remap_row_boxes_kernel(struct leaf_boxes const *boxes, unsigned char const *p,
+		int channels, int w, unsigned char *out)
+{
+	__m128i min[3], max[3];
+	for (int c = 0; c < 3; ++c) {
+		min[c] = _mm_loadu_si128((__m128i const *) boxes->min[c]);
+		max[c] = _mm_loadu_si128((__m128i const *) boxes->max[c]);
+	}
+	for (int x = 0; x < w; ++x, p += channels) {
+		struct color const color = load_color(p, channels);
+		__m128i inside = _mm_set1_epi8(-1);
+		for (int c = 0; c < 3; ++c) {
+			__m128i const v = _mm_set1_epi8(color.rgb[c]);
+			__m128i const clamped = _mm_max_epu8(_mm_min_epu8(v, max[c]), min[c]);
+			inside = _mm_and_si128(inside, _mm_cmpeq_epi8(clamped, v));
+		}
+		unsigned const lanes = _mm_movemask_epi8(inside) & boxes->lanes;
+		out[x] = boxes->index[__builtin_ctz(lanes)];
+	}
+}
+
+void remap_row_boxes_baseline(struct leaf_boxes const *boxes, unsigned char const *p, int channels,
+		int w, unsigned char *out)
+{
+	remap_row_boxes_kernel(boxes, p, channels, w, out);
+}
+
+/// Same as remap_row_boxes_kernel, but tests two pixels at once, one in each 128-bit half. Needs
+/// AVX2.
+CPU_KERNEL CPU_TARGET_AVX2 void remap_row_boxes_kernel_x2(struct leaf_boxes const *boxes,
+		unsigned char const *p, int channels, int w, unsigned char *out)
+{
+	__m256i min[3], max[3];
+	for (int c = 0; c < 3; ++c) {
+		min[c] = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i const *) boxes->min[c]));
+		max[c] = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i const *) boxes->max[c]));
+	}
+	unsigned const lanes = boxes->lanes | boxes->lanes << BOX_LANES;
+	int x = 0;
+	for (; x + 2 <= w; x += 2, p += 2 * channels) {
+		struct color const a = load_color(p, channels);
+		struct color const b = load_color(p + channels, channels);
+		__m256i inside = _mm256_set1_epi8(-1);
+		for (int c = 0; c < 3; ++c) {
+			__m256i const v = _mm256_setr_m128i(_mm_set1_epi8(a.rgb[c]), _mm_set1_epi8(b.rgb[c]));
+			__m256i const clamped = _mm256_max_epu8(_mm256_min_epu8(v, max[c]), min[c]);
+			inside = _mm256_and_si256(inside, _mm256_cmpeq_epi8(clamped, v));
+		}
+		unsigned const found = _mm256_movemask_epi8(inside) & lanes;
+		out[x] = boxes->index[__builtin_ctz(found & 0xffff)];
+		out[x + 1] = boxes->index[__builtin_ctz(found >> BOX_LANES)];
+	}
+	remap_row_boxes_kernel(boxes, p, channels, w - x, out + x);
+}
+
+CPU_TARGET_AVX2 void remap_row_boxes_avx2(struct leaf_boxes const *boxes, unsigned char const *p,
+		int channels, int w, unsigned char *out)
+{
+	remap_row_boxes_kernel_x2(boxes, p, channels, w, out);
+}
+
+CPU_TARGET_AVX512 void remap_row_boxes_avx512(struct leaf_boxes const *boxes,
+		unsigned char const *p, int channels, int w, unsigned char *out)
+{
+	remap_row_boxes_kernel_x2(boxes, p, channels, w, out);
+}
+#endif
+
+/// A sampled color, packed as 0xRRGGBB, and the number of samples of it.
+struct color_count {
+	uint32_t key;
+	uint32_t count;
+};
+
+#define EMPTY_KEY UINT32_MAX // Marks the free slots of struct color_table, never a packed color.
+
+/// The colors sampled by one thread of median_cut, in an open-addressed hash table with linear
+/// probing. Once the thread is done, the colors are sorted into 'entries' by their merge range.
+struct color_table {
+	struct color_count *slots;
+	int bits; // There are 2^bits slots.
+	int skip; // Number of leading bits of the hashes that are the same for all colors.
+	size_t used;
+	struct color_count *entries;
+	size_t starts[MERGE_RANGES + 1]; // The entries of merge range r are [starts[r], starts[r + 1]).
+};
+
+uint32_t color_key(struct color color)
+{
+	return (uint32_t) color.rgb[0] << 16 | color.rgb[1] << 8 | color.rgb[2];
+}
+
+uint32_t color_hash(uint32_t key)
+{
+	return key * 0x9e3779b1;
+}
+
+void init_color_table(struct color_table *table, int bits, int skip)
+{
+	*table = (struct color_table) {.slots = xmalloc(sizeof(struct color_count) << bits),
+			.bits = bits, .skip = skip};
+	memset(table->slots, 0xff, sizeof(struct color_count) << bits);
+}
+
+/// Returns the slot of 'table' that holds the color 'key' or the free slot where it belongs.
+static inline __attribute__((always_inline)) struct color_count *find_color_slot(
+		struct color_table const *table, uint32_t key)
+{
+	size_t const mask = ((size_t) 1 << table->bits) - 1;
+	size_t i = (uint32_t) (color_hash(key) << table->skip) >> (32 - table->bits);
+	while (table->slots[i].key != key && table->slots[i].key != EMPTY_KEY) {
+		i = (i + 1) & mask;
+	}
+	return &table->slots[i];
+}
+
+/// Doubles the number of slots of 'table'.
+void grow_color_table(struct color_table *table)
+{
+	struct color_table grown;
+	init_color_table(&grown, table->bits + 1, table->skip);
+	for (size_t i = 0; i < (size_t) 1 << table->bits; ++i) {
+		if (table->slots[i].key != EMPTY_KEY) {
+			*find_color_slot(&grown, table->slots[i].key) = table->slots[i];
+		}
+	}
+	free(table->slots);
+	table->slots = grown.slots;
+	table->bits = grown.bits;
+}
+
+/// Adds 'count' samples of the color 'key' to 'table'. A quarter of the slots at most are used, so
+/// that most colors are found at the first slot that is looked at.
+static inline __attribute__((always_inline)) void count_color(struct color_table *table,
+		uint32_t key, uint32_t count)
+{
+	struct color_count *slot = find_color_slot(table, key);
+	if (slot->key == EMPTY_KEY) {
+		if (4 * (table->used + 1) > (size_t) 1 << table->bits) {
+			grow_color_table(table);
+			slot = find_color_slot(table, key);
+		}
+		*slot = (struct color_count) {key, 0};
+		++table->used;
+	}
+	slot->count += count;
+}
+
+/// Moves the colors of 'table' to table->entries, sorted by their merge range.
+void sort_color_table(struct color_table *table)
+{
+	size_t const slot_count = (size_t) 1 << table->bits;
+	memset(table->starts, 0, sizeof(table->starts));
+	for (size_t i = 0; i < slot_count; ++i) {
+		if (table->slots[i].key != EMPTY_KEY) {
+			++table->starts[(color_hash(table->slots[i].key) >> (32 - MERGE_RANGE_BITS)) + 1];
+		}
+	}
+	for (int r = 0; r < MERGE_RANGES; ++r) {
+		table->starts[r + 1] += table->starts[r];
+	}
+	size_t pos[MERGE_RANGES];
+	memcpy(pos, table->starts, sizeof(pos));
+	table->entries = xmalloc(table->used * sizeof(struct color_count));
+	for (size_t i = 0; i < slot_count; ++i) {
+		if (table->slots[i].key != EMPTY_KEY) {
+			uint32_t const r = color_hash(table->slots[i].key) >> (32 - MERGE_RANGE_BITS);
+			table->entries[pos[r]++] = table->slots[i];
+		}
+	}
+	free(table->slots);
+	table->slots = NULL;
+}
+
+/// Work shared by the threads of median_cut and the remap procedures. Rows are numbered across
+/// all images, so that a single image is split between threads just like many frames are.
+struct rows_job {
+	struct palette const *palette;
+	struct image const *images;
+	size_t rows_per_image;
+	int step;
+	struct planes samples; // median_cut: the pixels of every step-th row, step pixels apart.
+	struct color_table **tables; // median_cut: the colors of each thread, at its first row.
+	bool crowded; // median_cut: set by the first table that gives up to stop all of them.
+	struct leaf_boxes const *boxes; // remap: the leaves of small palettes, NULL to walk the tree.
+	unsigned char *indices; // remap_indices: one palette index per pixel.
+};
+
+/// Copies the sampled pixels of the rows [begin, end) into job->samples.
+void sample_rows(void *ctx, size_t begin, size_t end)
+{
+	struct rows_job const *job = ctx;
+	size_t const sample_w = (job->images[0].w + job->step - 1) / job->step;
+	for (size_t r = begin; r < end; ++r) {
+		struct image const *image = &job->images[r / job->rows_per_image];
+		size_t const y = r % job->rows_per_image * job->step;
+		unsigned char const *row = image->pixels + y * image->w * image->channels;
+		size_t i = r * sample_w;
+		for (size_t x = 0; x < (size_t) image->w; x += job->step, ++i) {
+			struct color const color = load_color(row + x * image->channels, image->channels);
+			for (int c = 0; c < 3; ++c) {
+				job->samples.chan[c][i] = color.rgb[c];
+			}
+		}
+	}
+}
+
+/// Counts the sampled colors of the rows [begin, end) in a table of their own, which is stored
+/// at job->tables[begin], so that the threads do not have to share anything but job->crowded.
+void count_rows(void *ctx, size_t begin, size_t end)
+{
+	struct rows_job *job = ctx;
+	struct color_table *table = xmalloc(sizeof(*table));
+	init_color_table(table, 12, 0);
+	job->tables[begin] = table;
+	size_t samples = 0;
+	for (size_t r = begin; r < end; ++r) {
+		struct image const *image = &job->images[r / job->rows_per_image];
+		size_t const y = r % job->rows_per_image * job->step;
+		unsigned char const *row = image->pixels + y * image->w * image->channels;
+		// The tables of photos outgrow the caches, so the slots of the colors a few pixels ahead
+		// are prefetched.
+		uint32_t keys[COUNT_BATCH];
+		for (size_t x = 0; x < (size_t) image->w;) {
+			int n = 0;
+			for (; n < COUNT_BATCH && x < (size_t) image->w; ++n, x += job->step) {
+				keys[n] = color_key(load_color(row + x * image->channels, image->channels));
+			}
+			for (int i = 0; i < n; ++i) {
+				if (i + COUNT_PREFETCH < n) {
+					uint32_t const ahead = color_hash(keys[i + COUNT_PREFETCH]);
+					__builtin_prefetch(&table->slots[ahead >> (32 - table->bits)]);
+				}
+				count_color(table, keys[i], 1);
+			}
+			samples += n;
+			if (samples >= COUNT_MIN_SAMPLES && 2 * table->used > samples) {
+				__atomic_store_n(&job->crowded, true, __ATOMIC_RELAXED);
+			}
+			if (__atomic_load_n(&job->crowded, __ATOMIC_RELAXED)) {
+				free(table->slots);
+				table->slots = NULL;
+				return;
+			}
+		}
+	}
+	sort_color_table(table);
+}
+
+/// Work of merge_ranges and store_ranges.
+struct merge_job {
+	struct color_table *const *tables;
+	size_t table_count;
+	struct color_count *merged; // Merge range r uses the space of all of its entries from starts[r].
+	size_t starts[MERGE_RANGES + 1];
+	size_t counts[MERGE_RANGES]; // Number of distinct colors of each merge range.
+	size_t positions[MERGE_RANGES]; // Position of the colors of each merge range in 'colors'.
+	struct planes colors;
+};
+
+/// Merges the colors of all tables in the merge ranges [begin, end). Every range holds different
+/// colors, so that the threads never write to the same memory.
+void merge_ranges(void *ctx, size_t begin, size_t end)
+{
+	struct merge_job *job = ctx;
+	for (size_t r = begin; r < end; ++r) {
+		struct color_count *out = job->merged + job->starts[r];
+		size_t const total = job->starts[r + 1] - job->starts[r];
+		int sources = 0;
+		for (size_t t = 0; t < job->table_count; ++t) {
+			sources += job->tables[t]->starts[r + 1] > job->tables[t]->starts[r];
+		}
+		if (sources <= 1) {
+			// A single table already holds every color once.
+			for (size_t t = 0; t < job->table_count; ++t) {
+				struct color_table const *table = job->tables[t];
+				size_t const n = table->starts[r + 1] - table->starts[r];
+				memcpy(out, table->entries + table->starts[r], n * sizeof(struct color_count));
+				out += n;
+			}
+			job->counts[r] = total;
+			continue;
+		}
+		// All colors of the range share the leading bits of their hashes, so the slots are chosen
+		// by the bits behind them.
+		int bits = 1;
+		while (((size_t) 1 << bits) < 4 * total && bits < 32 - MERGE_RANGE_BITS) {
+			++bits;
+		}
+		struct color_table merged;
+		init_color_table(&merged, bits, MERGE_RANGE_BITS);
+		for (size_t t = 0; t < job->table_count; ++t) {
+			struct color_table const *table = job->tables[t];
+			for (size_t i = table->starts[r]; i < table->starts[r + 1]; ++i) {
+				count_color(&merged, table->entries[i].key, table->entries[i].count);
+			}
+		}
+		for (size_t i = 0; i < ((size_t) 1 << bits); ++i) {
+			if (merged.slots[i].key != EMPTY_KEY) {
+				*out++ = merged.slots[i];
+			}
+		}
+		free(merged.slots);
+		job->counts[r] = merged.used;
+	}
+}
+
+/// Stores the merged colors of the ranges [begin, end) in job->colors.
+void store_ranges(void *ctx, size_t begin, size_t end)
+{
+	struct merge_job const *job = ctx;
+	for (size_t r = begin; r < end; ++r) {
+		struct color_count const *in = job->merged + job->starts[r];
+		size_t const pos = job->positions[r];
+		for (size_t i = 0; i < job->counts[r]; ++i) {
+			job->colors.chan[0][pos + i] = in[i].key >> 16;
+			job->colors.chan[1][pos + i] = in[i].key >> 8;
+			job->colors.chan[2][pos + i] = in[i].key;
+			job->colors.weights[pos + i] = in[i].count;
+		}
+	}
+}
+
+/// Returns the distinct colors of the sampled pixels with the number of samples of each as
+/// weights, or a count of zero if there are too many of them to be worth it. The rows are counted
+/// by every thread on its own and the results are merged by ranges of hashes in parallel.
+struct build_bucket count_colors(struct rows_job *job, size_t row_count)
+{
+	struct build_bucket result = {.count = 0};
+	job->tables = xmalloc(row_count * sizeof(struct color_table *));
+	for (size_t r = 0; r < row_count; ++r) {
+		job->tables[r] = NULL;
+	}
+	parallel_for(row_count, count_rows, job);
+
+	struct merge_job merge = {.tables = job->tables};
+	for (size_t r = 0; r < row_count; ++r) {
+		if (job->tables[r] != NULL) {
+			job->tables[merge.table_count++] = job->tables[r];
+		}
+	}
+	if (!job->crowded) {
+		for (size_t t = 0; t < merge.table_count; ++t) {
+			for (int r = 0; r < MERGE_RANGES; ++r) {
+				merge.starts[r + 1] += merge.tables[t]->starts[r + 1]
+						- merge.tables[t]->starts[r];
+			}
+		}
+		for (int r = 0; r < MERGE_RANGES; ++r) {
+			merge.starts[r + 1] += merge.starts[r];
+		}
+		merge.merged = xmalloc(merge.starts[MERGE_RANGES] * sizeof(struct color_count));
+		parallel_for(MERGE_RANGES, merge_ranges, &merge);
+
+		for (int r = 0; r < MERGE_RANGES; ++r) {
+			merge.positions[r] = result.count;
+			result.count += merge.counts[r];
+		}
+		// The cuts move the colors of every bucket between 'data' and 'spare'. The weights come
+		// first in both of them to stay aligned.
+		size_t const n = result.count;
+		uint32_t *temp = xmalloc(2 * (sizeof(uint32_t) + 3) * n);
+		uint32_t *scratch = temp + n;
+		unsigned char *temp_chan = (unsigned char *) (scratch + n);
+		unsigned char *scratch_chan = temp_chan + 3 * n;
+		result.data = (struct planes) {{temp_chan, temp_chan + n, temp_chan + 2 * n}, temp};
+		result.spare = (struct planes) {{scratch_chan, scratch_chan + n, scratch_chan + 2 * n},
+				scratch};
+		merge.colors = result.data;
+		parallel_for(MERGE_RANGES, store_ranges, &merge);
+		free(merge.merged);
+	}
+
+	for (size_t t = 0; t < merge.table_count; ++t) {
+		free(merge.tables[t]->entries);
+		free(merge.tables[t]);
+	}
+	free(job->tables);
+	job->tables = NULL;
+	return result;
+}
+
+void median_cut(struct palette *palette, int palette_count, struct image const *images,
+		int image_count, int step)
+{
+	assert(palette_count > 0 && palette_count <= MAX_PALETTE);
+	assert(image_count > 0 && step > 0);
+	size_t sample_w = (images[0].w + step - 1) / step;
+	size_t sample_h = (images[0].h + step - 1) / step;
+	size_t sample_count = sample_w * sample_h * image_count;
+	struct build_bucket builds[MAX_PALETTE * 2 - 1];
+	struct rows_job job = {
+			.images = images,
+			.rows_per_image = sample_h,
+			.step = step
+	};
+
+	// Most images have far fewer colors than pixels, and the cuts only need each of them once
+	// with its number of samples. The weights are 32 bits wide.
+	builds[0] = (struct build_bucket) {.count = 0};
+	if (sample_count <= UINT32_MAX) {
+		builds[0] = count_colors(&job, sample_h * image_count);
+	}
+	if (builds[0].count == 0) {
+		// The cuts move the colors of every bucket between 'temp' and 'scratch'.
+		unsigned char *temp = xmalloc(2 * 3 * sample_count);
+		unsigned char *scratch = temp + 3 * sample_count;
+		builds[0] = (struct build_bucket) {
+				.data = {{temp, temp + sample_count, temp + 2 * sample_count}},
+				.spare = {{scratch, scratch + sample_count, scratch + 2 * sample_count}},
+				.count = sample_count
+		};
+		job.samples = builds[0].data;
+		parallel_for(sample_h * image_count, sample_rows, &job);
+	}
+	// Both buffers are a single allocation, which starts at either of them.
+	void *buffers = builds[0].data.weights != NULL ? (void *) builds[0].data.weights
+			: builds[0].data.chan[0];
+
+	struct node *nodes = palette->nodes;
+	int nodes_count = 0;
+	nodes[nodes_count++] = make_bucket(&builds[0].data, builds[0].count, sample_count);
+
+	for (int p = 1; p < palette_count; ++p) {
+		// Find the bucket with the largest range.
+		struct node *largest = NULL;
+		unsigned char max_range = 0;
+		for (int i = 0; i < nodes_count; ++i) {
+			if (nodes[i].leaf && nodes[i].bucket.range >= max_range) {
+				max_range = nodes[i].bucket.range;
+				largest = &nodes[i];
+			}
+		}
+		if (max_range == 0) {
+			// There are no more buckets that can be divided.
+			break;
+		}
+
+		// Cut the bucket with the largest range into two buckets.
+		cut_bucket(&nodes[nodes_count], &nodes[nodes_count + 1], largest, &builds[largest - nodes],
+				&builds[nodes_count], &builds[nodes_count + 1]);
+		nodes_count += 2;
+	}
+
+	palette->colors_count = 0;
+	for (int i = 0; i < nodes_count; ++i) {
+		if (nodes[i].leaf) {
+			struct bucket *bucket = &nodes[i].bucket;
+			bucket->avg_color = compute_average_color(&builds[i].data, builds[i].count,
+					bucket->data_count);
+			bucket->index = palette->colors_count;
+			palette->colors[palette->colors_count++] = bucket->avg_color;
+		}
+	}
+	palette->nodes_count = nodes_count;
+	free(buffers);
+
+	// The cache of the previous tree is useless. Fresh zero pages only cost memory once touched,
+	// so that the setup scales with the colors that are actually remapped.
+	free_palette(palette);
+	palette->cache = calloc(CACHE_SIZE, 1);
+	palette->cache_colors = calloc((size_t) 1 << CACHE_COLORS_BITS, sizeof(uint32_t));
+	if (palette->cache == NULL || palette->cache_colors == NULL) {
+		fatal("no memory");
+	}
+	palette->tree_code = compile_tree(palette);
+}
+
+void free_palette(struct palette *palette)
+{
+	free(palette->cache);
+	free(palette->cache_colors);
+	free_tree_code(palette->tree_code);
+	palette->cache = NULL;
+	palette->cache_colors = NULL;
+	palette->tree_code = NULL;
+}
+
+/// Returns the value of the cell of palette->cache that contains 'color', see struct palette.
+unsigned char cache_cell_value(struct palette const *palette, struct color color)
+{
+	struct node const *node = &palette->nodes[0];
+	while (!node->leaf) {
+		int const min = color.rgb[node->split.chan] >> CACHE_SHIFT << CACHE_SHIFT;
+		int const max = min + (1 << CACHE_SHIFT) - 1;
+		if (max <= node->split.threshold) {
+			node = node->split.left;
+		} else if (min > node->split.threshold) {
+			node = node->split.right;
+		} else {
+			break;
+		}
+	}
+	return node - palette->nodes + 1;
+}
+
+/// Returns the leaf of 'palette' whose bucket contains 'color', using and filling both levels of
+/// palette->cache. Threads that fill the same cell at the same time store the same value, and a
+/// slot of the second level always holds a complete entry of one of them, so the races are
+/// benign. The relaxed atomics only make sure that every value is read and written as a whole. Always
+/// inlined, as passing the 3-byte color to a call costs more than the lookup itself.
+static inline __attribute__((always_inline)) struct node const *find_cached_leaf(
+		struct palette const *palette, struct color color)
+{
+	size_t const cell = (size_t) (color.rgb[0] >> CACHE_SHIFT) << 2 * (8 - CACHE_SHIFT)
+			| (color.rgb[1] >> CACHE_SHIFT) << (8 - CACHE_SHIFT) | color.rgb[2] >> CACHE_SHIFT;
+	unsigned char value = __atomic_load_n(&palette->cache[cell], __ATOMIC_RELAXED);
+	if (value == 0) {
+		value = cache_cell_value(palette, color);
+		__atomic_store_n(&palette->cache[cell], value, __ATOMIC_RELAXED);
+	}
+	struct node const *node = &palette->nodes[value - 1];
+	if (node->leaf) {
+		return node;
+	}
+
+	// The cell spans a split, so look up the exact color in the second level and only walk the
+	// subtree below 'node' if it is not there.
+	uint32_t const key = (uint32_t) color.rgb[0] << 16 | color.rgb[1] << 8 | color.rgb[2];
+	size_t const slot = (key * 2654435761u) >> (32 - CACHE_COLORS_BITS); // Fibonacci hashing
+	uint32_t const entry = __atomic_load_n(&palette->cache_colors[slot], __ATOMIC_RELAXED);
+	if (entry >> 24 != 0 && (entry & 0xffffff) == key) {
+		return &palette->nodes[(entry >> 24) - 1];
+	}
+	uint32_t position;
+	if (palette->tree_code != NULL) {
+		tree_func *walk = palette->tree_code->entry[node - palette->nodes];
+		position = walk(color.rgb[0], color.rgb[1], color.rgb[2]) + 1;
+	} else {
+		position = find_leaf(node, color) - palette->nodes + 1;
+	}
+	__atomic_store_n(&palette->cache_colors[slot], key | position << 24, __ATOMIC_RELAXED);
+	return &palette->nodes[position - 1];
+}
+
+/// Replaces the pixels of the rows [begin, end) with their quantized colors.
+void remap_rows(void *ctx, size_t begin, size_t end)
+{
+	struct rows_job const *job = ctx;
+	unsigned char *indices = job->boxes != NULL ? xmalloc(job->images[0].w) : NULL;
+	for (size_t r = begin; r < end; ++r) {
+		struct image const *image = &job->images[r / job->rows_per_image];
+		int const channels = image->channels;
+		unsigned char *p = image->pixels + r % job->rows_per_image * image->w * channels;
+#ifdef CPU_X86
+		if (job->boxes != NULL) {
+			CPU_DISPATCH(remap_row_boxes, job->boxes, p, channels, image->w, indices);
+			for (int x = 0; x < image->w; ++x, p += channels) {
+				store_color(p, channels, job->palette->colors[indices[x]]);
+			}
+			continue;
+		}
+#endif
+		for (int x = 0; x < image->w; ++x, p += channels) {
+			struct node const *leaf = find_cached_leaf(job->palette, load_color(p, channels));
+			store_color(p, channels, leaf->bucket.avg_color);
+		}
+	}
+	free(indices);
+}
+
+/// Returns 'boxes' filled for 'palette' if remapping with them is faster than the tree walk, and
+/// NULL otherwise.
+struct leaf_boxes const *choose_leaf_boxes(struct leaf_boxes *boxes, struct palette const *palette)
+{
+#ifdef CPU_X86
+	return make_leaf_boxes(boxes, palette) ? boxes : NULL;
+#else
+	(void) boxes, (void) palette;
+	return NULL;
+#endif
+}
+
+void remap_image(struct palette const *palette, struct image *images, int image_count)
+{
+	struct leaf_boxes boxes;
+	struct rows_job job = {.palette = palette, .images = images, .rows_per_image = images[0].h,
+			.boxes = choose_leaf_boxes(&boxes, palette)};
+	parallel_for((size_t) images[0].h * image_count, remap_rows, &job);
+}
+
+/// Stores the palette indices of the pixels of the rows [begin, end) in job->indices.
+void remap_index_rows(void *ctx, size_t begin, size_t end)
+{
+	struct rows_job const *job = ctx;
+	for (size_t r = begin; r < end; ++r) {
+		struct image const *image = &job->images[r / job->rows_per_image];
+		int const channels = image->channels;
+		unsigned char const *p = image->pixels + r % job->rows_per_image * image->w * channels;
+		unsigned char *out = job->indices + r * image->w;
+#ifdef CPU_X86
+		if (job->boxes != NULL) {
+			CPU_DISPATCH(remap_row_boxes, job->boxes, p, channels, image->w, out);
+			continue;
+		}
+#endif
+		for (int x = 0; x < image->w; ++x, p += channels) {
+			out[x] = find_cached_leaf(job->palette, load_color(p, channels))->bucket.index;
+		}
+	}
+}
+
+void remap_indices(struct palette const *palette, struct image const *images, int image_count,
+		unsigned char *indices)
+{
+	struct leaf_boxes boxes;
+	struct rows_job job = {.palette = palette, .images = images, .rows_per_image = images[0].h,
+			.boxes = choose_leaf_boxes(&boxes, palette), .indices = indices};
+	parallel_for((size_t) images[0].h * image_count, remap_index_rows, &job);
+}
+
+/// Luminance of 'color' in units of 1/1000 (Rec. 601 weights).
+int luminance(struct color color)
+{
+	return 299 * color.rgb[0] + 587 * color.rgb[1] + 114 * color.rgb[2];
+}
+
+void reorder_palette(struct palette *palette, enum palette_order order)
+{
+	if (order == ORDER_NODES) {
+		return;
+	}
+	// Insertion sort, which is stable and fast enough for MAX_PALETTE elements. old_index[i] is
+	// the old index of the new color i.
+	int const n = palette->colors_count;
+	unsigned char old_index[MAX_PALETTE];
+	for (int i = 0; i < n; ++i) {
+		unsigned char c = i;
+		int j = i;
+		while (j > 0 && luminance(palette->colors[old_index[j - 1]])
+				> luminance(palette->colors[c])) {
+			old_index[j] = old_index[j - 1];
+			--j;
+		}
+		old_index[j] = c;
+	}
+
+	unsigned char map[MAX_PALETTE];
+	struct color colors[MAX_PALETTE];
+	memcpy(colors, palette->colors, sizeof(colors));
+	for (int i = 0; i < n; ++i) {
+		palette->colors[i] = colors[old_index[i]];
+		map[old_index[i]] = i;
+	}
+	for (int i = 0; i < palette->nodes_count; ++i) {
+		if (palette->nodes[i].leaf) {
+			palette->nodes[i].bucket.index = map[palette->nodes[i].bucket.index];
+		}
+	}
+}
@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2023 Andrey Proskurin (proskur1n)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef MEDIANCUT_H
+#define MEDIANCUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MAX_PALETTE 128
+
+/// A packed RGB color. Alpha is never stored, as the quantized image is always opaque.
+struct color {
+	unsigned char rgb[3];
+};
+
+/// An 8-bit image in one of the channel layouts returned by stb_image: 1 (gray), 2 (gray, alpha),
+/// 3 (RGB) or 4 (RGBA).
+struct image {
+	unsigned char *pixels;
+	int w;
+	int h;
+	int channels;
+};
+
+// Internal nodes of the binary tree.
+struct split {
+	struct node *left; // Contains values less-or-equals than the 'threshold'.
+	struct node *right; // Contains values larger than the 'threshold'.
+	unsigned char threshold;
+	unsigned char chan;
+};
+
+// Leaf nodes of the binary tree.
+struct bucket {
+	size_t data_count; // Number of sampled colors in the bucket.
+	struct color avg_color;
+	unsigned char range; // Range of the longest dimension (range_chan)
+	unsigned char range_chan; // 0: red, 1: green, 2: blue
+	unsigned char index; // Position of avg_color in palette->colors
+};
+
+// The split and bucket types are declared outside of the union, so that C++ accepts this header.
+struct node {
+	union {
+		struct split split;
+		struct bucket bucket;
+	};
+	bool leaf;
+};
+
+/// The binary tree built by the median cut algorithm. The root is always nodes[0] and every leaf
+/// holds one palette color.
+struct palette {
+	struct node nodes[MAX_PALETTE * 2 - 1];
+	int nodes_count;
+	struct color colors[MAX_PALETTE]; // Average colors of the leaves in the order of 'nodes'
+	int colors_count;
+	// Cache of the remap procedures with one cell per block of 4x4x4 colors, shared by all threads
+	// and all remaps with this palette. Every cell starts at 0 and is filled on its first lookup
+	// with 1 + the position in 'nodes' of the deepest node that contains the whole cell, which is
+	// where lookups of its colors continue. For most cells, that is already the leaf.
+	unsigned char *cache;
+	// Second level of the cache for the colors of cells that span more than one leaf. A hash table
+	// of colors (low 24 bits) and 1 + the position of their leaf in 'nodes' (high 8 bits), where
+	// every color simply replaces the previous one in its slot.
+	uint32_t *cache_colors;
+	struct tree_code *tree_code; // The tree compiled to machine code, NULL if not supported.
+};
+
+/// Order of the colors in the palette of indexed images.
+enum palette_order {
+	ORDER_NODES, // The order in which median_cut created the buckets.
+	ORDER_LUMINANCE, // From dark to bright.
+};
+
+/// Performs the median cut color quantization algorithm on the pixels of all given images and
+/// stores the resulting tree in 'palette', which must be zero-initialized or hold the result of
+/// an earlier call. The images must all have the same size and channel
+/// layout, e.g. the frames of an animation. They are not modified, see remap_image.
+/// @param palette_count Number of distinct colors in the output image. Must be <= MAX_PALETTE.
+/// @param images Image pixels
+/// @param image_count Array length in 'images'.
+/// @param step Only every step-th pixel of every step-th row is used to build the palette. With a
+///             step of 8, this is exactly the first pass of an Adam7 interlaced image.
+void median_cut(struct palette *palette, int palette_count, struct image const *images,
+		int image_count, int step);
+
+/// Frees the memory of a palette built by median_cut.
+void free_palette(struct palette *palette);
+
+/// Computes the quantized color using the provided palette specified by its root node.
+struct color lookup_color_from_palette(struct node const *root, struct color color);
+
+/// Same as lookup_color_from_palette, but returns the position of the color in palette->colors.
+unsigned char lookup_index_from_palette(struct node const *root, struct color color);
+
+/// Replaces every pixel of the given images with its quantized color from 'palette'. The images
+/// keep their channel layout and become fully opaque.
+void remap_image(struct palette const *palette, struct image *images, int image_count);
+
+/// Stores the palette index of every pixel of the given images in 'indices', which must hold
+/// w * h * image_count elements. The images must all have the same size and channel layout.
+void remap_indices(struct palette const *palette, struct image const *images, int image_count,
+		unsigned char *indices);
+
+/// Sorts the colors of 'palette' into 'order'. The orders only depend on the colors, so this is
+/// done before the remap and costs nothing per pixel.
+void reorder_palette(struct palette *palette, enum palette_order order);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
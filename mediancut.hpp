@@ -0,0 +1,265 @@
+/*
+ * Copyright (c) 2023 Andrey Proskurin (proskur1n)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef MEDIANCUT_HPP
+#define MEDIANCUT_HPP
+
+// Header-only C++20 interface of the quantizer. The pixel format, the palette size class and the
+// index type are template parameters, so that the compiler can unroll the channel loops, drop the
+// alpha handling of opaque formats and inline the lookup into the remap loop of the caller. Link
+// with the objects of the C sources, which still build the tree.
+
+#include <array>
+#include <bit>
+#include <cassert>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+#include "mediancut.h"
+
+namespace mediancut {
+
+/// Order of the color channels of a pixel in memory.
+enum class channel_order {
+	rgb,
+	bgr,
+};
+
+/// Layout of an 8-bit pixel with 1 (gray), 2 (gray, alpha), 3 (color) or 4 (color, alpha)
+/// channels. Gray pixels are loaded as r = g = b, alpha is ignored by lookups and stored as 255.
+template<int Channels, channel_order Order = channel_order::rgb>
+struct pixel_format {
+	static_assert(Channels >= 1 && Channels <= 4);
+	static_assert(Channels >= 3 || Order == channel_order::rgb, "gray pixels have no channel order");
+
+	static constexpr int channels = Channels;
+	static constexpr bool has_alpha = Channels == 2 || Channels == 4;
+
+	/// Returns the position of color channel 'chan' (0: red, 1: green, 2: blue) within a pixel.
+	static constexpr int offset(int chan)
+	{
+		if (Channels < 3) {
+			return 0;
+		}
+		return Order == channel_order::bgr ? 2 - chan : chan;
+	}
+
+	static color load(unsigned char const *p)
+	{
+		return {{p[offset(0)], p[offset(1)], p[offset(2)]}};
+	}
+
+	/// Writes 'c' to the pixel at 'p' and makes it fully opaque. Gray layouts only store the red
+	/// channel, which is correct as long as the palette was built from gray pixels only.
+	static void store(unsigned char *p, color c)
+	{
+		if constexpr (Channels < 3) {
+			p[0] = c.rgb[0];
+		} else {
+			for (int chan = 0; chan < 3; ++chan) {
+				p[offset(chan)] = c.rgb[chan];
+			}
+		}
+		if constexpr (has_alpha) {
+			p[Channels - 1] = 255;
+		}
+	}
+};
+
+using gray = pixel_format<1>;
+using gray_alpha = pixel_format<2>;
+using rgb = pixel_format<3>;
+using rgba = pixel_format<4>;
+using bgr = pixel_format<3, channel_order::bgr>;
+using bgra = pixel_format<4, channel_order::bgr>;
+
+/// Size class of a palette, which selects the lookup of remapper.
+enum class palette_size {
+	small, // Up to 16 colors: every pixel is tested against the boxes of all leaves at once.
+	large, // Up to MAX_PALETTE colors: the tree is walked.
+};
+
+/// Owns the tree built by median_cut. A palette cannot be copied or moved, as its nodes point to
+/// each other.
+class palette {
+public:
+	/// Builds a palette of up to 'colors' colors from the w x h pixels in 'Format' at 'pixels'.
+	/// Only every step-th pixel of every step-th row is used, as in median_cut.
+	template<class Format>
+	palette(Format, std::span<unsigned char const> pixels, int w, int h, int colors, int step = 1)
+	{
+		assert(pixels.size() >= static_cast<std::size_t>(w) * h * Format::channels);
+		assert(colors > 0 && colors <= MAX_PALETTE && step > 0);
+		if constexpr (Format::offset(0) == 0 && Format::offset(2) == (Format::channels < 3 ? 0 : 2)) {
+			// The C code reads these layouts directly.
+			image const im = {const_cast<unsigned char *>(pixels.data()), w, h, Format::channels};
+			median_cut(&data, colors, &im, 1, step);
+		} else {
+			// Gather the samples in RGB order first, which yields exactly the same samples.
+			int const sample_w = (w + step - 1) / step, sample_h = (h + step - 1) / step;
+			std::vector<unsigned char> samples(static_cast<std::size_t>(sample_w) * sample_h * 3);
+			unsigned char *out = samples.data();
+			for (int y = 0; y < h; y += step) {
+				unsigned char const *row = pixels.data() + static_cast<std::size_t>(y) * w * Format::channels;
+				for (int x = 0; x < w; x += step, out += 3) {
+					color const c = Format::load(row + static_cast<std::size_t>(x) * Format::channels);
+					out[0] = c.rgb[0];
+					out[1] = c.rgb[1];
+					out[2] = c.rgb[2];
+				}
+			}
+			image const im = {samples.data(), sample_w, sample_h, 3};
+			median_cut(&data, colors, &im, 1, 1);
+		}
+	}
+
+	palette(palette const &) = delete;
+	palette &operator=(palette const &) = delete;
+
+	~palette()
+	{
+		free_palette(&data);
+	}
+
+	/// Returns the palette colors, in the order of the indices of remapper.
+	std::span<color const> colors() const
+	{
+		return {data.colors, static_cast<std::size_t>(data.colors_count)};
+	}
+
+	/// Sorts the colors by luminance, see reorder_palette.
+	void sort_by_luminance()
+	{
+		reorder_palette(&data, ORDER_LUMINANCE);
+	}
+
+	/// The underlying C palette, e.g. for remap_indices or the image writers.
+	::palette const &get() const
+	{
+		return data;
+	}
+
+private:
+	::palette data{};
+};
+
+/// Maps pixels in 'Format' to the colors of a palette. The lookup is fully inlined and has no
+/// virtual dispatch. A remapper refers to its palette, which must outlive it and must not be
+/// reordered in the meantime.
+template<class Format, palette_size Size = palette_size::large>
+class remapper {
+public:
+	explicit remapper(palette const &p) : nodes(p.get().nodes), colors(p.get().colors)
+	{
+		if constexpr (Size == palette_size::small) {
+			assert(p.get().colors_count <= max_lanes);
+			std::array<int, 3> const min = {0, 0, 0}, max = {255, 255, 255};
+			collect(&nodes[0], min, max);
+		}
+	}
+
+	/// Returns the palette index of the pixel at 'p'.
+	unsigned char index(unsigned char const *p) const
+	{
+		color const c = Format::load(p);
+		if constexpr (Size == palette_size::small) {
+			// A lane contains the pixel if clamping it to the bounds of the lane does not change it.
+			// The loops have constant trip counts, so the compiler unrolls or vectorizes them.
+			std::uint32_t found = 0;
+			for (int lane = 0; lane < max_lanes; ++lane) {
+				bool inside = true;
+				for (int chan = 0; chan < 3; ++chan) {
+					inside &= boxes.min[chan][lane] <= c.rgb[chan] && c.rgb[chan] <= boxes.max[chan][lane];
+				}
+				found |= static_cast<std::uint32_t>(inside) << lane;
+			}
+			return boxes.index[std::countr_zero(found & boxes.lanes)];
+		} else {
+			node const *n = &nodes[0];
+			while (!n->leaf) {
+				n = c.rgb[n->split.chan] <= n->split.threshold ? n->split.left : n->split.right;
+			}
+			return n->bucket.index;
+		}
+	}
+
+	/// Stores the palette index of every pixel of 'pixels' in 'out'.
+	template<std::unsigned_integral Index>
+	void remap(std::span<unsigned char const> pixels, std::span<Index> out) const
+	{
+		assert(out.size() * Format::channels <= pixels.size());
+		unsigned char const *p = pixels.data();
+		for (Index &i : out) {
+			i = index(p);
+			p += Format::channels;
+		}
+	}
+
+	/// Replaces every pixel of 'pixels' with its quantized color and makes it fully opaque.
+	void remap(std::span<unsigned char> pixels) const
+	{
+		unsigned char *end = pixels.data() + pixels.size() / Format::channels * Format::channels;
+		for (unsigned char *p = pixels.data(); p != end; p += Format::channels) {
+			Format::store(p, colors[index(p)]);
+		}
+	}
+
+private:
+	static constexpr int max_lanes = 16;
+
+	/// The boxes of the reachable leaves, one lane per leaf, as in the SIMD remap of the C code.
+	struct leaf_boxes {
+		std::array<std::array<unsigned char, max_lanes>, 3> min{};
+		std::array<std::array<unsigned char, max_lanes>, 3> max{};
+		std::array<unsigned char, max_lanes> index{};
+		std::uint32_t lanes = 0;
+		int count = 0;
+	};
+
+	void collect(node const *n, std::array<int, 3> min, std::array<int, 3> max)
+	{
+		for (int chan = 0; chan < 3; ++chan) {
+			if (min[chan] > max[chan]) {
+				return; // No color reaches this subtree.
+			}
+		}
+		if (n->leaf) {
+			int const lane = boxes.count++;
+			for (int chan = 0; chan < 3; ++chan) {
+				boxes.min[chan][lane] = min[chan];
+				boxes.max[chan][lane] = max[chan];
+			}
+			boxes.index[lane] = n->bucket.index;
+			boxes.lanes |= 1u << lane;
+			return;
+		}
+		std::array<int, 3> left_max = max, right_min = min;
+		left_max[n->split.chan] = n->split.threshold;
+		right_min[n->split.chan] = n->split.threshold + 1;
+		collect(n->split.left, min, left_max);
+		collect(n->split.right, right_min, max);
+	}
+
+	node const *nodes;
+	color const *colors;
+	leaf_boxes boxes;
+};
+
+} // namespace mediancut
+
+#endif
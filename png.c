@@ -0,0 +1,285 @@
+/*
+ * Copyright (c) 2023 Andrey Proskurin (proskur1n)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "png.h"
+#include "checksum.h"
+#include "cpu.h"
+#include "util.h"
+
+#define FILTER_LANES 64 // Bytes that png_filter_row filters at once.
+
+/// Returns the number of bits per palette index of an indexed image.
+int index_depth(struct png_image const *image)
+{
+	int const n = image->palette_count;
+	return n <= 2 ? 1 : n <= 4 ? 2 : n <= 16 ? 4 : 8;
+}
+
+size_t png_row_size(struct png_image const *image)
+{
+	if (image->palette != NULL) {
+		return ((size_t) image->w * index_depth(image) + 7) / 8 + 1;
+	}
+	return (size_t) image->w * image->channels + 1;
+}
+
+/// Returns the filtered value of the byte 'x' with the bytes 'a' to its left, 'b' above it and 'c'
+/// above 'a'.
+CPU_KERNEL unsigned char filter_byte(int filter, unsigned char x, unsigned char a, unsigned char b,
+		unsigned char c)
+{
+	switch (filter) {
+	case 1:
+		return x - a;
+	case 2:
+		return x - b;
+	case 3:
+		return x - ((a + b) >> 1);
+	case 4: {
+		// Paeth predictor with p = a + b - c, written without branches.
+		short const pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - 2 * c);
+		return x - (pa <= pb && pa <= pc ? a : pb <= pc ? b : c);
+	}
+	default:
+		return x;
+	}
+}
+
+/// Applies filter type 'filter' to the row 'cur' of 'size' bytes with 'prev' as the row above,
+/// stores the result in 'out' and returns the sum of the absolute filtered values. The bytes are
+/// processed in blocks of FILTER_LANES, which the compiler vectorizes once 'filter' is a constant.
+CPU_KERNEL unsigned filter_bytes(int filter, unsigned char const *restrict cur,
+		unsigned char const *restrict prev, size_t size, size_t bpp, unsigned char *restrict out)
+{
+	unsigned sum = 0;
+	size_t i = 0;
+	// The first pixel has no left neighbor.
+	for (; i < bpp && i < size; ++i) {
+		out[i] = filter_byte(filter, cur[i], 0, prev[i], 0);
+		sum += abs((signed char) out[i]);
+	}
+	for (; i + FILTER_LANES <= size; i += FILTER_LANES) {
+		unsigned block_sum = 0;
+		for (int j = 0; j < FILTER_LANES; ++j) {
+			size_t const k = i + j;
+			out[k] = filter_byte(filter, cur[k], cur[k - bpp], prev[k], prev[k - bpp]);
+			block_sum += abs((signed char) out[k]);
+		}
+		sum += block_sum;
+	}
+	for (; i < size; ++i) {
+		out[i] = filter_byte(filter, cur[i], cur[i - bpp], prev[i], prev[i - bpp]);
+		sum += abs((signed char) out[i]);
+	}
+	return sum;
+}
+
+CPU_KERNEL unsigned filter_row_kernel(int filter, unsigned char const *cur,
+		unsigned char const *prev, size_t size, size_t bpp, unsigned char *out)
+{
+	switch (filter) {
+	case 1:
+		return filter_bytes(1, cur, prev, size, bpp, out);
+	case 2:
+		return filter_bytes(2, cur, prev, size, bpp, out);
+	case 3:
+		return filter_bytes(3, cur, prev, size, bpp, out);
+	case 4:
+		return filter_bytes(4, cur, prev, size, bpp, out);
+	default:
+		return filter_bytes(0, cur, prev, size, bpp, out);
+	}
+}
+
+unsigned filter_row_baseline(int filter, unsigned char const *cur, unsigned char const *prev,
+		size_t size, size_t bpp, unsigned char *out)
+{
+	return filter_row_kernel(filter, cur, prev, size, bpp, out);
+}
+
+#ifdef CPU_X86
+CPU_TARGET_AVX2 unsigned filter_row_avx2(int filter, unsigned char const *cur,
+		unsigned char const *prev, size_t size, size_t bpp, unsigned char *out)
+{
+	return filter_row_kernel(filter, cur, prev, size, bpp, out);
+}
+
+CPU_TARGET_AVX512 unsigned filter_row_avx512(int filter, unsigned char const *cur,
+		unsigned char const *prev, size_t size, size_t bpp, unsigned char *out)
+{
+	return filter_row_kernel(filter, cur, prev, size, bpp, out);
+}
+#endif
+
+/// Packs the palette indices of row y of 'image' into 'out' at the bit depth of the image.
+void pack_indices(struct png_image const *image, int y, unsigned char *out)
+{
+	int const depth = index_depth(image);
+	unsigned char const *indices = image->pixels + (size_t) y * image->w;
+	if (depth == 8) {
+		memcpy(out, indices, image->w);
+		return;
+	}
+	memset(out, 0, png_row_size(image) - 1);
+	for (int x = 0; x < image->w; ++x) {
+		out[x * depth / 8] |= indices[x] << (8 - depth - x * depth % 8);
+	}
+}
+
+void png_filter_row(struct png_image const *image, int y, int filter, unsigned char *out)
+{
+	bool const given = filter >= 0 && filter <= 4;
+	if (image->palette != NULL && !given) {
+		out[0] = 0;
+		pack_indices(image, y, out + 1);
+		return;
+	}
+
+	// The first row is filtered as if there was a row of zeros above it. Indexed rows are packed
+	// first, together with the row above.
+	size_t const size = png_row_size(image) - 1;
+	size_t const bpp = image->palette != NULL ? 1 : image->channels;
+	unsigned char *rows = NULL;
+	unsigned char const *cur, *prev;
+	if (image->palette != NULL) {
+		rows = xmalloc(2 * size);
+		memset(rows, 0, size);
+		if (y > 0) {
+			pack_indices(image, y - 1, rows);
+		}
+		pack_indices(image, y, rows + size);
+		prev = rows;
+		cur = rows + size;
+	} else {
+		cur = image->pixels + y * size;
+		if (y == 0) {
+			rows = calloc(size, 1);
+			if (rows == NULL) {
+				fatal("no memory");
+			}
+		}
+		prev = y > 0 ? cur - size : rows;
+	}
+	if (!given) {
+		// Try every filter in 'out', which is overwritten with the best one below.
+		unsigned best_sum = UINT32_MAX;
+		for (int f = 0; f < 5; ++f) {
+			unsigned sum = CPU_DISPATCH(filter_row, f, cur, prev, size, bpp, out + 1);
+			if (sum < best_sum) {
+				best_sum = sum;
+				filter = f;
+			}
+		}
+	}
+	out[0] = filter;
+	CPU_DISPATCH(filter_row, filter, cur, prev, size, bpp, out + 1);
+	free(rows);
+}
+
+void put_u32(unsigned char *p, uint32_t value)
+{
+	p[0] = value >> 24;
+	p[1] = value >> 16;
+	p[2] = value >> 8;
+	p[3] = value;
+}
+
+void write_chunk(char const *type, void const *data, size_t size, png_write_func *write, void *context)
+{
+	unsigned char header[8], crc[4];
+	put_u32(header, size);
+	memcpy(header + 4, type, 4);
+	put_u32(crc, crc32_update(crc32_update(0, type, 4), data, size));
+	write(context, header, sizeof(header));
+	if (size > 0) {
+		write(context, data, size);
+	}
+	write(context, crc, sizeof(crc));
+}
+
+/// Collects compressed data into IDAT chunks of at most PNG_CHUNK_SIZE bytes.
+struct idat_writer {
+	unsigned char *data;
+	size_t size;
+	png_write_func *write;
+	void *context;
+};
+
+void write_idat(void *context, unsigned char const *data, size_t size)
+{
+	struct idat_writer *idat = context;
+	while (size > 0) {
+		size_t n = PNG_CHUNK_SIZE - idat->size < size ? PNG_CHUNK_SIZE - idat->size : size;
+		memcpy(idat->data + idat->size, data, n);
+		idat->size += n;
+		data += n;
+		size -= n;
+		if (idat->size == PNG_CHUNK_SIZE) {
+			write_chunk("IDAT", idat->data, idat->size, idat->write, idat->context);
+			idat->size = 0;
+		}
+	}
+}
+
+void png_encode(struct png_image const *image, enum deflate_strategy strategy, int level, int filter,
+		png_write_func *write, void *context)
+{
+	static unsigned char const signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+	static unsigned char const color_types[5] = {0, 0, 4, 2, 6};
+	write(context, signature, sizeof(signature));
+	unsigned char ihdr[13];
+	put_u32(ihdr, image->w);
+	put_u32(ihdr + 4, image->h);
+	ihdr[8] = image->palette != NULL ? index_depth(image) : 8;
+	ihdr[9] = image->palette != NULL ? 3 : color_types[image->channels];
+	ihdr[10] = ihdr[11] = ihdr[12] = 0; // Deflate, adaptive filtering, no interlacing
+	write_chunk("IHDR", ihdr, sizeof(ihdr), write, context);
+	if (image->palette != NULL) {
+		write_chunk("PLTE", image->palette, 3 * image->palette_count, write, context);
+	}
+
+	struct idat_writer idat = {xmalloc(PNG_CHUNK_SIZE), 0, write, context};
+	size_t const row_size = png_row_size(image);
+	if (strategy == DEFLATE_OPTIMAL) {
+		unsigned char *rows = xmalloc(row_size * image->h);
+		for (int y = 0; y < image->h; ++y) {
+			png_filter_row(image, y, filter, rows + y * row_size);
+		}
+		size_t size = 0;
+		unsigned char *zlib = zlib_compress_optimal(rows, row_size * image->h, &size, level);
+		write_idat(&idat, zlib, size);
+		free(zlib);
+		free(rows);
+	} else {
+		struct deflate_stream *stream = deflate_open(strategy, level, write_idat, &idat);
+		unsigned char *row = xmalloc(row_size);
+		for (int y = 0; y < image->h; ++y) {
+			png_filter_row(image, y, filter, row);
+			deflate_write(stream, row, row_size);
+		}
+		deflate_close(stream);
+		free(row);
+	}
+	if (idat.size > 0) {
+		write_chunk("IDAT", idat.data, idat.size, write, context);
+	}
+	free(idat.data);
+	write_chunk("IEND", NULL, 0, write, context);
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2023 Andrey Proskurin (proskur1n)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef PNG_H
+#define PNG_H
+
+#include <stddef.h>
+#include "deflate.h"
+
+#define PNG_CHUNK_SIZE (1 << 16) // Maximum data size of the IDAT chunks of png_encode.
+
+typedef void png_write_func(void *context, void const *data, size_t size);
+
+/// An image for png_encode. Pixels have 'channels' (1 to 4) interleaved bytes, or are a single
+/// palette index if 'palette' is not NULL. Indices are packed into the smallest bit depth that fits
+/// the palette.
+struct png_image {
+	int w, h;
+	int channels;
+	unsigned char const *pixels;
+	unsigned char const *palette; // RGB triplets.
+	int palette_count;
+};
+
+/// Returns the size of one filtered row of 'image', including the filter type.
+size_t png_row_size(struct png_image const *image);
+
+/// Filters row y of 'image' into 'out'. The filter type is 'filter' if it is 0 to 4, and otherwise
+/// the one with the smallest sum of absolute differences, as in stb_image_write. Indexed images
+/// use filter type 0 unless 'filter' is given, since palette indices are not predictable from their
+/// neighbors. A given filter works on the bytes of the packed indices, as PNG defines it.
+void png_filter_row(struct png_image const *image, int y, int filter, unsigned char *out);
+
+/// Writes 'image' as a PNG file through write(context, ...) while it is encoded: every row is
+/// filtered and fed to a deflate_stream with 'strategy' and 'level', whose output is written in
+/// IDAT chunks of at most PNG_CHUNK_SIZE bytes. The memory used only depends on the width, except
+/// for DEFLATE_OPTIMAL, which needs all filtered rows at once.
+/// @param level Search effort of DEFLATE_SEARCH, or the passes of DEFLATE_OPTIMAL.
+/// @param filter Filter type of every row, see png_filter_row.
+void png_encode(struct png_image const *image, enum deflate_strategy strategy, int level, int filter,
+		png_write_func *write, void *context);
+
+#endif
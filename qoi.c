@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2023 Andrey Proskurin (proskur1n)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include "qoi.h"
+#include "util.h"
+
+// See https://qoiformat.org/qoi-specification.pdf for the format.
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF 0x40
+#define QOI_OP_LUMA 0x80
+#define QOI_OP_RUN 0xc0
+#define QOI_OP_RGB 0xfe
+#define QOI_OP_RGBA 0xff
+#define QOI_MASK 0xc0
+#define QOI_HEADER_SIZE 14
+
+unsigned char const qoi_padding[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+
+struct qoi_rgba {
+	unsigned char r, g, b, a;
+};
+
+int qoi_hash(struct qoi_rgba px)
+{
+	return (px.r * 3 + px.g * 5 + px.b * 7 + px.a * 11) % 64;
+}
+
+bool qoi_equal(struct qoi_rgba a, struct qoi_rgba b)
+{
+	return a.r == b.r && a.g == b.g && a.b == b.b && a.a == b.a;
+}
+
+uint32_t qoi_read32(unsigned char const *p)
+{
+	return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+unsigned char *qoi_write32(unsigned char *p, uint32_t v)
+{
+	*p++ = v >> 24;
+	*p++ = v >> 16;
+	*p++ = v >> 8;
+	*p++ = v;
+	return p;
+}
+
+unsigned char *qoi_decode(unsigned char const *data, size_t size, int *w, int *h, int *channels)
+{
+	if (size < QOI_HEADER_SIZE + sizeof(qoi_padding) || memcmp(data, "qoif", 4) != 0) {
+		return NULL;
+	}
+	uint32_t width = qoi_read32(data + 4);
+	uint32_t height = qoi_read32(data + 8);
+	int chan = data[12];
+	if (width == 0 || height == 0 || (chan != 3 && chan != 4)
+			|| (uint64_t) width * height > INT_MAX / 4) {
+		return NULL;
+	}
+
+	size_t const pixel_count = (size_t) width * height;
+	unsigned char *pixels = xmalloc(pixel_count * chan);
+	unsigned char *out = pixels;
+	unsigned char const *p = data + QOI_HEADER_SIZE;
+	unsigned char const *end = data + size - sizeof(qoi_padding);
+	struct qoi_rgba index[64] = {0};
+	struct qoi_rgba px = {0, 0, 0, 255};
+	int run = 0;
+	for (size_t i = 0; i < pixel_count; ++i) {
+		if (run > 0) {
+			--run;
+		} else if (p < end) {
+			int b1 = *p++;
+			if (b1 == QOI_OP_RGB || b1 == QOI_OP_RGBA) {
+				if (end - p < (b1 == QOI_OP_RGB ? 3 : 4)) {
+					break;
+				}
+				px.r = *p++;
+				px.g = *p++;
+				px.b = *p++;
+				if (b1 == QOI_OP_RGBA) {
+					px.a = *p++;
+				}
+			} else if ((b1 & QOI_MASK) == QOI_OP_INDEX) {
+				px = index[b1];
+			} else if ((b1 & QOI_MASK) == QOI_OP_DIFF) {
+				px.r += ((b1 >> 4) & 3) - 2;
+				px.g += ((b1 >> 2) & 3) - 2;
+				px.b += (b1 & 3) - 2;
+			} else if ((b1 & QOI_MASK) == QOI_OP_LUMA) {
+				if (p == end) {
+					break;
+				}
+				int b2 = *p++;
+				int dg = (b1 & 0x3f) - 32;
+				px.r += dg - 8 + ((b2 >> 4) & 0x0f);
+				px.g += dg;
+				px.b += dg - 8 + (b2 & 0x0f);
+			} else {
+				run = b1 & 0x3f;
+			}
+			index[qoi_hash(px)] = px;
+		} else {
+			break;
+		}
+		*out++ = px.r;
+		*out++ = px.g;
+		*out++ = px.b;
+		if (chan == 4) {
+			*out++ = px.a;
+		}
+	}
+	if (out != pixels + pixel_count * chan) {
+		free(pixels);
+		return NULL;
+	}
+	*w = (int) width;
+	*h = (int) height;
+	*channels = chan;
+	return pixels;
+}
+
+/// Reads the pixel at 'p' as RGBA. Gray pixels are expanded to r = g = b.
+struct qoi_rgba qoi_load(unsigned char const *p, int channels)
+{
+	switch (channels) {
+	case 1:
+		return (struct qoi_rgba) {p[0], p[0], p[0], 255};
+	case 2:
+		return (struct qoi_rgba) {p[0], p[0], p[0], p[1]};
+	case 3:
+		return (struct qoi_rgba) {p[0], p[1], p[2], 255};
+	default:
+		return (struct qoi_rgba) {p[0], p[1], p[2], p[3]};
+	}
+}
+
+unsigned char *qoi_encode(unsigned char const *pixels, int w, int h, int channels, size_t *size)
+{
+	int const out_channels = channels == 2 || channels == 4 ? 4 : 3;
+	size_t const pixel_count = (size_t) w * h;
+	// Every pixel takes at most one tag byte plus its channels.
+	unsigned char *data = xmalloc(QOI_HEADER_SIZE + pixel_count * (out_channels + 1) + sizeof(qoi_padding));
+	unsigned char *p = data;
+	memcpy(p, "qoif", 4);
+	p = qoi_write32(p + 4, w);
+	p = qoi_write32(p, h);
+	*p++ = out_channels;
+	*p++ = 0; // sRGB with linear alpha
+
+	struct qoi_rgba index[64] = {0};
+	struct qoi_rgba prev = {0, 0, 0, 255};
+	int run = 0;
+	for (size_t i = 0; i < pixel_count; ++i) {
+		struct qoi_rgba px = qoi_load(pixels + i * channels, channels);
+		if (qoi_equal(px, prev)) {
+			if (++run == 62 || i == pixel_count - 1) {
+				*p++ = QOI_OP_RUN | (run - 1);
+				run = 0;
+			}
+			continue;
+		}
+		if (run > 0) {
+			*p++ = QOI_OP_RUN | (run - 1);
+			run = 0;
+		}
+
+		int hash = qoi_hash(px);
+		if (qoi_equal(index[hash], px)) {
+			*p++ = QOI_OP_INDEX | hash;
+		} else if (px.a == prev.a) {
+			index[hash] = px;
+			signed char dr = px.r - prev.r;
+			signed char dg = px.g - prev.g;
+			signed char db = px.b - prev.b;
+			signed char dr_dg = dr - dg;
+			signed char db_dg = db - dg;
+			if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+				*p++ = QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+			} else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+				*p++ = QOI_OP_LUMA | (dg + 32);
+				*p++ = (dr_dg + 8) << 4 | (db_dg + 8);
+			} else {
+				*p++ = QOI_OP_RGB;
+				*p++ = px.r;
+				*p++ = px.g;
+				*p++ = px.b;
+			}
+		} else {
+			index[hash] = px;
+			*p++ = QOI_OP_RGBA;
+			*p++ = px.r;
+			*p++ = px.g;
+			*p++ = px.b;
+			*p++ = px.a;
+		}
+		prev = px;
+	}
+	memcpy(p, qoi_padding, sizeof(qoi_padding));
+	*size = p + sizeof(qoi_padding) - data;
+	return data;
+}
@@ -0,0 +1,31 @@
+/*
+ * Copyright (c) 2023 Andrey Proskurin (proskur1n)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef QOI_H
+#define QOI_H
+
+#include <stddef.h>
+
+/// Decodes the QOI image in 'data'. Returns the pixels in the channel layout stored in the header
+/// (RGB or RGBA) or NULL if the image is corrupt. The result must be freed by the caller.
+unsigned char *qoi_decode(unsigned char const *data, size_t size, int *w, int *h, int *channels);
+
+/// Encodes w * h pixels with 1 to 4 channels as a QOI image. Gray layouts are stored as RGB or
+/// RGBA, since QOI has no gray formats. The result must be freed by the caller.
+/// @param size Receives the size of the encoded image in bytes.
+unsigned char *qoi_encode(unsigned char const *pixels, int w, int h, int channels, size_t *size);
+
+#endif
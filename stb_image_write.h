@@ -106,6 +106,11 @@ USAGE:
    TGA supports RLE or non-RLE compressed data. To use non-RLE-compressed
    data, set the global variable 'stbi_write_tga_with_rle' to 0.
 
+   stbi_write_tga_indexed and stbi_write_bmp_indexed write one palette index
+   per pixel together with a palette of palette_len RGB triplets. TGA is
+   written as an 8-bit color-mapped image, RLE-compressed unless
+   'stbi_write_tga_with_rle' is 0, and BMP as an uncompressed 8-bit bitmap.
+
    JPEG does ignore alpha channels in input data; quality is between 1 and 100.
    Higher quality looks better but results in a bigger image.
    JPEG baseline (no JPEG progressive).
@@ -179,6 +184,9 @@ STBIWDEF int stbi_write_tga(char const *filename, int w, int h, int comp, const
 STBIWDEF int stbi_write_hdr(char const *filename, int w, int h, int comp, const float *data);
 STBIWDEF int stbi_write_jpg(char const *filename, int x, int y, int comp, const void  *data, int quality);
 
+STBIWDEF int stbi_write_tga_indexed(char const *filename, int w, int h, const void *indices, const unsigned char *palette, int palette_len);
+STBIWDEF int stbi_write_bmp_indexed(char const *filename, int w, int h, const void *indices, const unsigned char *palette, int palette_len);
+
 #ifdef STBIW_WINDOWS_UTF8
 STBIWDEF int stbiw_convert_wchar_to_utf8(char *buffer, size_t bufferlen, const wchar_t* input);
 #endif
@@ -189,6 +197,8 @@ typedef void stbi_write_func(void *context, void *data, int size);
 STBIWDEF int stbi_write_png_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const void  *data, int stride_in_bytes);
 STBIWDEF int stbi_write_bmp_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const void  *data);
 STBIWDEF int stbi_write_tga_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const void  *data);
+STBIWDEF int stbi_write_bmp_indexed_to_func(stbi_write_func *func, void *context, int w, int h, const void *indices, const unsigned char *palette, int palette_len);
+STBIWDEF int stbi_write_tga_indexed_to_func(stbi_write_func *func, void *context, int w, int h, const void *indices, const unsigned char *palette, int palette_len);
 STBIWDEF int stbi_write_hdr_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const float *data);
 STBIWDEF int stbi_write_jpg_to_func(stbi_write_func *func, void *context, int x, int y, int comp, const void  *data, int quality);
 
@@ -529,6 +539,108 @@ STBIWDEF int stbi_write_bmp(char const *filename, int x, int y, int comp, const
 }
 #endif //!STBI_WRITE_NO_STDIO
 
+static int stbi_write_bmp_indexed_core(stbi__write_context *s, int x, int y, const void *indices, const unsigned char *palette, int palette_len)
+{
+   int i, pad = (-x) & 3;
+   if (palette_len < 1 || palette_len > 256)
+      return 0;
+   stbiw__writef(s, "11 4 22 4" "4 44 22 444444",
+      'B', 'M', 14+40+4*palette_len+(x+pad)*y, 0,0, 14+40+4*palette_len, // file header
+      40, x,y, 1,8, 0,0,0,0,palette_len,0);                             // bitmap header
+   // the color table is stored as BGR0 quads
+   for (i = 0; i < palette_len; ++i) {
+      stbiw__write3(s, palette[3*i+2], palette[3*i+1], palette[3*i]);
+      stbiw__write1(s, 0);
+   }
+   stbiw__write_flush(s);
+   // one byte per pixel is the mono layout, which is written unchanged
+   return stbiw__outfile(s,-1,-1,x,y,1,0,(void *) indices,0,pad,"");
+}
+
+STBIWDEF int stbi_write_bmp_indexed_to_func(stbi_write_func *func, void *context, int x, int y, const void *indices, const unsigned char *palette, int palette_len)
+{
+   stbi__write_context s = { 0 };
+   stbi__start_write_callbacks(&s, func, context);
+   return stbi_write_bmp_indexed_core(&s, x, y, indices, palette, palette_len);
+}
+
+#ifndef STBI_WRITE_NO_STDIO
+STBIWDEF int stbi_write_bmp_indexed(char const *filename, int x, int y, const void *indices, const unsigned char *palette, int palette_len)
+{
+   stbi__write_context s = { 0 };
+   if (stbi__start_write_file(&s,filename)) {
+      int r = stbi_write_bmp_indexed_core(&s, x, y, indices, palette, palette_len);
+      stbi__end_write_file(&s);
+      return r;
+   } else
+      return 0;
+}
+#endif //!STBI_WRITE_NO_STDIO
+
+static void stbiw__write_tga_rle(stbi__write_context *s, int x, int y, int comp, int has_alpha, void *data)
+{
+   int i,j,k;
+   int jend, jdir;
+
+   if (stbi__flip_vertically_on_write) {
+      j = 0;
+      jend = y;
+      jdir = 1;
+   } else {
+      j = y-1;
+      jend = -1;
+      jdir = -1;
+   }
+   for (; j != jend; j += jdir) {
+      unsigned char *row = (unsigned char *) data + j * x * comp;
+      int len;
+
+      for (i = 0; i < x; i += len) {
+         unsigned char *begin = row + i * comp;
+         int diff = 1;
+         len = 1;
+
+         if (i < x - 1) {
+            ++len;
+            diff = memcmp(begin, row + (i + 1) * comp, comp);
+            if (diff) {
+               const unsigned char *prev = begin;
+               for (k = i + 2; k < x && len < 128; ++k) {
+                  if (memcmp(prev, row + k * comp, comp)) {
+                     prev += comp;
+                     ++len;
+                  } else {
+                     --len;
+                     break;
+                  }
+               }
+            } else {
+               for (k = i + 2; k < x && len < 128; ++k) {
+                  if (!memcmp(begin, row + k * comp, comp)) {
+                     ++len;
+                  } else {
+                     break;
+                  }
+               }
+            }
+         }
+
+         if (diff) {
+            unsigned char header = STBIW_UCHAR(len - 1);
+            stbiw__write1(s, header);
+            for (k = 0; k < len; ++k) {
+               stbiw__write_pixel(s, -1, comp, has_alpha, 0, begin + k * comp);
+            }
+         } else {
+            unsigned char header = STBIW_UCHAR(len - 129);
+            stbiw__write1(s, header);
+            stbiw__write_pixel(s, -1, comp, has_alpha, 0, begin);
+         }
+      }
+   }
+   stbiw__write_flush(s);
+}
+
 static int stbi_write_tga_core(stbi__write_context *s, int x, int y, int comp, void *data)
 {
    int has_alpha = (comp == 2 || comp == 4);
@@ -542,68 +654,8 @@ static int stbi_write_tga_core(stbi__write_context *s, int x, int y, int comp, v
       return stbiw__outfile(s, -1, -1, x, y, comp, 0, (void *) data, has_alpha, 0,
          "111 221 2222 11", 0, 0, format, 0, 0, 0, 0, 0, x, y, (colorbytes + has_alpha) * 8, has_alpha * 8);
    } else {
-      int i,j,k;
-      int jend, jdir;
-
       stbiw__writef(s, "111 221 2222 11", 0,0,format+8, 0,0,0, 0,0,x,y, (colorbytes + has_alpha) * 8, has_alpha * 8);
-
-      if (stbi__flip_vertically_on_write) {
-         j = 0;
-         jend = y;
-         jdir = 1;
-      } else {
-         j = y-1;
-         jend = -1;
-         jdir = -1;
-      }
-      for (; j != jend; j += jdir) {
-         unsigned char *row = (unsigned char *) data + j * x * comp;
-         int len;
-
-         for (i = 0; i < x; i += len) {
-            unsigned char *begin = row + i * comp;
-            int diff = 1;
-            len = 1;
-
-            if (i < x - 1) {
-               ++len;
-               diff = memcmp(begin, row + (i + 1) * comp, comp);
-               if (diff) {
-                  const unsigned char *prev = begin;
-                  for (k = i + 2; k < x && len < 128; ++k) {
-                     if (memcmp(prev, row + k * comp, comp)) {
-                        prev += comp;
-                        ++len;
-                     } else {
-                        --len;
-                        break;
-                     }
-                  }
-               } else {
-                  for (k = i + 2; k < x && len < 128; ++k) {
-                     if (!memcmp(begin, row + k * comp, comp)) {
-                        ++len;
-                     } else {
-                        break;
-                     }
-                  }
-               }
-            }
-
-            if (diff) {
-               unsigned char header = STBIW_UCHAR(len - 1);
-               stbiw__write1(s, header);
-               for (k = 0; k < len; ++k) {
-                  stbiw__write_pixel(s, -1, comp, has_alpha, 0, begin + k * comp);
-               }
-            } else {
-               unsigned char header = STBIW_UCHAR(len - 129);
-               stbiw__write1(s, header);
-               stbiw__write_pixel(s, -1, comp, has_alpha, 0, begin);
-            }
-         }
-      }
-      stbiw__write_flush(s);
+      stbiw__write_tga_rle(s, x, y, comp, has_alpha, data);
    }
    return 1;
 }
@@ -628,6 +680,46 @@ STBIWDEF int stbi_write_tga(char const *filename, int x, int y, int comp, const
 }
 #endif
 
+static int stbi_write_tga_indexed_core(stbi__write_context *s, int x, int y, void *indices, const unsigned char *palette, int palette_len)
+{
+   int i;
+   if (y < 0 || x < 0 || palette_len < 1 || palette_len > 256)
+      return 0;
+
+   // color-mapped image (type 1, or 9 with RLE) with a 24-bit BGR color map
+   stbiw__writef(s, "111 221 2222 11", 0,1,stbi_write_tga_with_rle ? 9 : 1, 0,palette_len,24, 0,0,x,y, 8, 0);
+   for (i = 0; i < palette_len; ++i)
+      stbiw__write3(s, palette[3*i+2], palette[3*i+1], palette[3*i]);
+   stbiw__write_flush(s);
+
+   // indices are stored like single channel pixels
+   if (!stbi_write_tga_with_rle)
+      stbiw__write_pixels(s, -1, -1, x, y, 1, indices, 0, 0, 0);
+   else
+      stbiw__write_tga_rle(s, x, y, 1, 0, indices);
+   return 1;
+}
+
+STBIWDEF int stbi_write_tga_indexed_to_func(stbi_write_func *func, void *context, int x, int y, const void *indices, const unsigned char *palette, int palette_len)
+{
+   stbi__write_context s = { 0 };
+   stbi__start_write_callbacks(&s, func, context);
+   return stbi_write_tga_indexed_core(&s, x, y, (void *) indices, palette, palette_len);
+}
+
+#ifndef STBI_WRITE_NO_STDIO
+STBIWDEF int stbi_write_tga_indexed(char const *filename, int x, int y, const void *indices, const unsigned char *palette, int palette_len)
+{
+   stbi__write_context s = { 0 };
+   if (stbi__start_write_file(&s,filename)) {
+      int r = stbi_write_tga_indexed_core(&s, x, y, (void *) indices, palette, palette_len);
+      stbi__end_write_file(&s);
+      return r;
+   } else
+      return 0;
+}
+#endif
+
 // *************************************************************************************************
 // Radiance RGBE HDR writer
 // by Baldur Karlsson
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2023 Andrey Proskurin (proskur1n)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "stream.h"
+#include "imageio.h"
+#include "mediancut.h"
+#include "util.h"
+
+// Scene changes are detected with a coarse histogram using the top HISTOGRAM_BITS of every channel.
+#define HISTOGRAM_BITS 4
+#define HISTOGRAM_SIZE (1 << 3 * HISTOGRAM_BITS)
+
+/// Counts the pixels of an RGBA image in a coarse 3D histogram.
+void compute_histogram(unsigned int *histogram, struct image const *image)
+{
+	int const shift = 8 - HISTOGRAM_BITS;
+	memset(histogram, 0, HISTOGRAM_SIZE * sizeof(*histogram));
+	unsigned char const *p = image->pixels;
+	for (size_t i = 0; i < (size_t) image->w * image->h; ++i, p += image->channels) {
+		++histogram[(p[0] >> shift) << 2 * HISTOGRAM_BITS | (p[1] >> shift) << HISTOGRAM_BITS | p[2] >> shift];
+	}
+}
+
+/// Returns the fraction of pixels that would have to change their histogram bin to turn one
+/// histogram into the other. Both must count the same number of pixels.
+double histogram_distance(unsigned int const *a, unsigned int const *b, size_t pixel_count)
+{
+	size_t diff = 0;
+	for (size_t i = 0; i < HISTOGRAM_SIZE; ++i) {
+		diff += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+	}
+	return (double) diff / 2 / pixel_count;
+}
+
+/// Reads exactly 'size' bytes from 'in'. Returns false on a clean end of the stream before the
+/// first byte and aborts on a truncated frame.
+bool read_frame(FILE *in, unsigned char *data, size_t size)
+{
+	size_t n = fread(data, 1, size, in);
+	if (n == 0 && feof(in)) {
+		return false;
+	}
+	if (n != size) {
+		fatal(ferror(in) ? "cannot read frame" : "truncated frame at the end of the stream");
+	}
+	return true;
+}
+
+void quantize_stream(FILE *in, FILE *out, int w, int h, int palette_count, int step, double threshold)
+{
+	size_t const pixel_count = (size_t) w * h;
+	struct image frame = {.pixels = xmalloc(pixel_count * 4), .w = w, .h = h, .channels = 4};
+	unsigned char *indices = xmalloc(pixel_count + 1);
+	unsigned int *histogram = xmalloc(HISTOGRAM_SIZE * sizeof(*histogram));
+	// Histogram of the frame the current palette was built from.
+	unsigned int *palette_histogram = xmalloc(HISTOGRAM_SIZE * sizeof(*histogram));
+	struct palette palette = {0};
+	bool have_palette = false;
+
+	while (read_frame(in, frame.pixels, pixel_count * 4)) {
+		compute_histogram(histogram, &frame);
+		if (!have_palette || histogram_distance(histogram, palette_histogram, pixel_count) > threshold) {
+			// Scene change: rebuild the tree and send the new palette.
+			median_cut(&palette, palette_count, &frame, 1, step);
+			unsigned int *swap = palette_histogram;
+			palette_histogram = histogram;
+			histogram = swap;
+			have_palette = true;
+
+			write_palette_record(out, &palette);
+		}
+		// Common case: only remap the frame with the previous tree.
+		indices[0] = 'F';
+		remap_indices(&palette, &frame, 1, indices + 1);
+		if (fwrite(indices, 1, pixel_count + 1, out) != pixel_count + 1) {
+			fatal("cannot write frame");
+		}
+	}
+	if (fflush(out) != 0) {
+		fatal("cannot write frame");
+	}
+
+	free_palette(&palette);
+	free(palette_histogram);
+	free(histogram);
+	free(indices);
+	free(frame.pixels);
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2023 Andrey Proskurin (proskur1n)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdio.h>
+
+/// Quantizes a stream of raw w * h RGBA frames read from 'in' and writes the result to 'out' as a
+/// sequence of records:
+///  - Palette update: the byte 'P', the number of colors minus one, then the colors as RGB.
+///  - Frame: the byte 'F' followed by w * h palette indices.
+/// Every frame is preceded by at least one palette update. The palette of the previous frame is
+/// reused as long as the color distribution does not change by more than 'threshold'.
+/// @param threshold Fraction of the pixels that must have moved to a different region of the
+///                  color space before the palette is rebuilt. The palette is rebuilt when more
+///                  than this fraction moved, so 0 rebuilds it for every frame that differs from
+///                  the one the palette was built from, and keeps it for repeated frames.
+void quantize_stream(FILE *in, FILE *out, int w, int h, int palette_count, int step, double threshold);
+
+#endif
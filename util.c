@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2023 Andrey Proskurin (proskur1n)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "util.h"
+
+char const *argv0 = "mediancut";
+int thread_count = 0;
+
+void fatal(char const *format, ...)
+{
+	va_list va;
+	va_start(va, format);
+	fprintf(stderr, "%s: ", argv0);
+	vfprintf(stderr, format, va);
+	fputc('\n', stderr);
+	va_end(va);
+	exit(EXIT_FAILURE);
+}
+
+void *xmalloc(size_t size)
+{
+	void *p = malloc(size);
+	if (p == NULL && size > 0) {
+		fatal("no memory");
+	}
+	return p;
+}
+
+struct job {
+	void (*fn)(void *ctx, size_t begin, size_t end);
+	void *ctx;
+	size_t begin;
+	size_t end;
+};
+
+void *run_job(void *arg)
+{
+	struct job *job = arg;
+	job->fn(job->ctx, job->begin, job->end);
+	return NULL;
+}
+
+void parallel_for(size_t count, void (*fn)(void *ctx, size_t begin, size_t end), void *ctx)
+{
+	if (thread_count <= 0) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		thread_count = n < 1 ? 1 : n > MAX_THREADS ? MAX_THREADS : (int) n;
+	}
+	size_t n = (size_t) thread_count < count ? (size_t) thread_count : count;
+	if (n <= 1) {
+		if (count > 0) {
+			fn(ctx, 0, count);
+		}
+		return;
+	}
+
+	struct job jobs[MAX_THREADS];
+	pthread_t threads[MAX_THREADS];
+	for (size_t i = 0; i < n; ++i) {
+		jobs[i] = (struct job) {.fn = fn, .ctx = ctx, .begin = count * i / n, .end = count * (i + 1) / n};
+	}
+	// The calling thread takes the first range itself.
+	for (size_t i = 1; i < n; ++i) {
+		if (pthread_create(&threads[i], NULL, run_job, &jobs[i]) != 0) {
+			fatal("cannot create thread");
+		}
+	}
+	run_job(&jobs[0]);
+	for (size_t i = 1; i < n; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2023 Andrey Proskurin (proskur1n)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef UTIL_H
+#define UTIL_H
+
+#include <stddef.h>
+
+#define MAX_THREADS 256
+
+extern char const *argv0;
+
+/// Number of threads used by parallel_for. Defaults to the number of online processors.
+extern int thread_count;
+
+/// Prints a formatted error message to the stderr and aborts the program.
+void fatal(char const *format, ...);
+
+/// Allocates 'size' bytes of memory and aborts the program on failure.
+void *xmalloc(size_t size);
+
+/// Calls fn(ctx, begin, end) on disjoint ranges that together cover [0, count). The ranges are
+/// processed by up to 'thread_count' threads and the call returns once all of them are done.
+void parallel_for(size_t count, void (*fn)(void *ctx, size_t begin, size_t end), void *ctx);
+
+#endif